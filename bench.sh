@@ -0,0 +1,78 @@
+#! /bin/sh --
+# Benchmark of pts-swiggle on a synthetic corpus, per image category.
+#
+# Usage: ./bench.sh [-s] [<extra pts-swiggle flags>...]
+#
+#   -s  Save the results as the new baseline (bench_baseline.txt).
+#
+# Builds pts-swiggle (with ./c.sh) and gen_corpus, generates the corpus to
+# bench_corpus/ (unless it already exists), runs pts-swiggle -f on each
+# category directory BENCH_REPEAT times (default: 3), and reports the best
+# images/s and input MB/s of each category, compared to the baseline.
+# Default pts-swiggle flags: -j1 -H 480.
+set -e
+cd "${0%/*}"
+
+SAVE=
+if test "$1" = -s; then SAVE=1; shift; fi
+REPEAT="${BENCH_REPEAT:-3}"
+CORPUS=bench_corpus
+BASELINE=bench_baseline.txt
+RESULTS=bench_results.txt
+
+./c.sh >/dev/null
+gcc -s -O2 -W -Wall -Wextra -Werror -o gen_corpus gen_corpus.c -ljpeg -lpng
+if ! test -d "$CORPUS"; then
+  echo "Generating corpus to $CORPUS/ ..." >&2
+  ./gen_corpus "$CORPUS.tmp" >/dev/null
+  mv "$CORPUS.tmp" "$CORPUS"
+fi
+
+now() { date +%s.%N; }
+
+: >"$RESULTS"
+for DIR in "$CORPUS"/*/; do
+  CATEGORY="${DIR%/}"; CATEGORY="${CATEGORY##*/}"
+  IMAGES=0; BYTES=0
+  for F in "$DIR"*; do
+    case "$F" in *.th.jpg) continue ;; esac
+    IMAGES=$((IMAGES + 1))
+    BYTES=$((BYTES + $(wc -c <"$F")))
+  done
+  BEST=
+  I=0
+  while test "$I" -lt "$REPEAT"; do
+    START="$(now)"
+    ./pts-swiggle -f -j1 -H 480 "$@" "$DIR" >/dev/null
+    END="$(now)"
+    BEST="$(awk -v s="$START" -v e="$END" -v b="$BEST" 'BEGIN { t = e - s; if (b == "" || t < b) b = t; printf "%.6f", b }')"
+    I=$((I + 1))
+  done
+  echo "$CATEGORY $IMAGES $BYTES $BEST" >>"$RESULTS"
+done
+
+# Report: one line per category, with the ratio to the baseline images/s.
+awk -v baseline="$BASELINE" '
+  BEGIN {
+    while ((getline line <baseline) > 0) {
+      if (line ~ /^#/) continue
+      split(line, f, " ")
+      base[f[1]] = f[5]
+    }
+    printf "%-28s %6s %8s %9s %9s %9s %7s\n", "category", "images", "MB", "seconds", "images/s", "MB/s", "vs_base"
+  }
+  {
+    ips = $2 / $4; mbps = $3 / 1e6 / $4
+    ratio = ($1 in base) && base[$1] > 0 ? sprintf("%.2fx", ips / base[$1]) : "-"
+    printf "%-28s %6d %8.2f %9.4f %9.1f %9.2f %7s\n", $1, $2, $3 / 1e6, $4, ips, mbps, ratio
+  }' "$RESULTS"
+
+if test "$SAVE"; then
+  {
+    echo "# pts-swiggle benchmark baseline: category images bytes seconds images/s"
+    echo "# flags: -f -j1 -H 480 $*"
+    echo "# $(uname -m) $(grep -m1 '^model name' /proc/cpuinfo 2>/dev/null | sed 's/^[^:]*: *//')"
+    awk '{ printf "%s %d %d %.6f %.2f\n", $1, $2, $3, $4, $2 / $4 }' "$RESULTS"
+  } >"$BASELINE"
+  echo "Saved baseline to $BASELINE." >&2
+fi
@@ -7,6 +7,6 @@ set -ex
 gcc -s -O3 -W -Wall -Wextra -Werror \
     -o pts-swiggle \
     pts-swiggle.c cgif.c \
-    -ljpeg -lpng -lm \
+    -ljpeg -lpng -lm -pthread \
 ;
 ls -l pts-swiggle
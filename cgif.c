@@ -146,7 +146,7 @@ static void *xrealloc(void *ptr, size_t size) {
 
 /* #define PROGRAM_NAME	"GIF_LIBRARY" */
 
-int _GifError = 0;
+GIF_THREAD_LOCAL int _GifError = 0;
 
 /*****************************************************************************
 * Return the last GIF error (0 if none) and reset the error.		     *
@@ -549,7 +549,8 @@ typedef struct GifFilePrivateType {
 	CrntShiftState;		        /* Number of bits in CrntShiftDWord. */
     unsigned long CrntShiftDWord;     /* For bytes decomposition into codes. */
     unsigned long PixelCount;		       /* Number of pixels in image. */
-    FILE *File;						  /* File as stream. */
+    FILE *File;				/* File as stream, NULL if reading Mem. */
+    const GifByteType *Mem, *MemEnd;		/* Input in memory, unless File. */
     GifByteType Buf[256];	       /* Compressed input is buffered here. */
     GifByteType Stack[LZ_MAX_CODE];	 /* Decoded pixels are stacked here. */
     GifByteType Suffix[LZ_MAX_CODE+1];	       /* So we can trace the codes. */
@@ -558,13 +559,14 @@ typedef struct GifFilePrivateType {
 
 /* extern int _GifError; */
 
-static int DGifGetWord(FILE *File, int *Word);
+static int DGifRead(GifFilePrivateType *Private, VoidPtr Buf, int Len);
+static int DGifGetWord(GifFilePrivateType *Private, int *Word);
 static int DGifSetupDecompress(GifFileType *GifFile);
 static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
 								int LineLen);
 static int DGifGetPrefixChar(unsigned int *Prefix, int Code, int ClearCode);
 static int DGifDecompressInput(GifFilePrivateType *Private, int *Code);
-static int DGifBufferedInput(FILE *File, GifByteType *Buf,
+static int DGifBufferedInput(GifFilePrivateType *Private, GifByteType *Buf,
 						     GifByteType *NextByte);
 
 /******************************************************************************
@@ -617,23 +619,45 @@ GifFileType *DGifOpenFileHandle(int FileHandle)
 }
 #endif
 
+static GifFileType *DGifOpenPrivate(GifFilePrivateType *Private);
+
 /**** pts ****/
 GifFileType *DGifOpenFILE(void/*FILE*/ *f) {
+    GifFilePrivateType *Private;
+
+    Private = (GifFilePrivateType *) xmalloc(sizeof(GifFilePrivateType));
+    /* Private->FileHandle = FileHandle; */
+    Private->File = (FILE*)f;
+    Private->Mem = Private->MemEnd = NULL;
+    return DGifOpenPrivate(Private);
+}
+
+/******************************************************************************
+*   Open a gif file for read from Data[0..Size-1], which must be kept until   *
+* DGifCloseFile.							      *
+******************************************************************************/
+GifFileType *DGifOpenMem(const void *Data, unsigned long Size) {
+    GifFilePrivateType *Private;
+
+    Private = (GifFilePrivateType *) xmalloc(sizeof(GifFilePrivateType));
+    Private->File = NULL;
+    Private->Mem = (const GifByteType *) Data;
+    Private->MemEnd = Private->Mem + Size;
+    return DGifOpenPrivate(Private);
+}
+
+static GifFileType *DGifOpenPrivate(GifFilePrivateType *Private) {
     char Buf[GIF_STAMP_LEN+1];
     GifFileType *GifFile;
-    GifFilePrivateType *Private;
     GifFile = (GifFileType *) xmalloc(sizeof(GifFileType));
 
     memset(GifFile, '\0', sizeof(GifFileType));
 
-    Private = (GifFilePrivateType *) xmalloc(sizeof(GifFilePrivateType));
     GifFile->Private = (VoidPtr) Private;
-    /* Private->FileHandle = FileHandle; */
-    Private->File = (FILE*)f;
     Private->FileState = 0;   /* Make sure bit 0 = 0 (File open for read). */
 
     /* Let's see if this is a GIF file: */
-    if (fread(Buf, 1, GIF_STAMP_LEN, Private->File) != GIF_STAMP_LEN) {
+    if (DGifRead(Private, Buf, GIF_STAMP_LEN) != GIF_STAMP_LEN) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	free((char *) Private);
 	free((char *) GifFile);
@@ -678,11 +702,11 @@ int DGifGetScreenDesc(GifFileType *GifFile)
     }
 
     /* Put the screen descriptor into the file: */
-    if (DGifGetWord(Private->File, &GifFile->SWidth) == GIF_ERROR ||
-	DGifGetWord(Private->File, &GifFile->SHeight) == GIF_ERROR)
+    if (DGifGetWord(Private, &GifFile->SWidth) == GIF_ERROR ||
+	DGifGetWord(Private, &GifFile->SHeight) == GIF_ERROR)
 	return GIF_ERROR;
 
-    if (fread(Buf, 1, 3, Private->File) != 3) {
+    if (DGifRead(Private, Buf, 3) != 3) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -696,7 +720,7 @@ int DGifGetScreenDesc(GifFileType *GifFile)
 
 	/* Get the global color map: */
 	for (i = 0; i < GifFile->SColorMap->ColorCount; i++) {
-	    if (fread(Buf, 1, 3, Private->File) != 3) {
+	    if (DGifRead(Private, Buf, 3) != 3) {
 		_GifError = D_GIF_ERR_READ_FAILED;
 		return GIF_ERROR;
 	    }
@@ -723,7 +747,7 @@ int DGifGetRecordType(GifFileType *GifFile, GifRecordType *Type)
 	return GIF_ERROR;
     }
 
-    if (fread(&Buf, 1, 1, Private->File) != 1) {
+    if (DGifRead(Private, &Buf, 1) != 1) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -760,12 +784,12 @@ int DGifGetImageDesc(GifFileType *GifFile)
 	return GIF_ERROR;
     }
 
-    if (DGifGetWord(Private->File, &Image.Left) == GIF_ERROR ||
-	DGifGetWord(Private->File, &Image.Top) == GIF_ERROR ||
-	DGifGetWord(Private->File, &Image.Width) == GIF_ERROR ||
-	DGifGetWord(Private->File, &Image.Height) == GIF_ERROR)
+    if (DGifGetWord(Private, &Image.Left) == GIF_ERROR ||
+	DGifGetWord(Private, &Image.Top) == GIF_ERROR ||
+	DGifGetWord(Private, &Image.Width) == GIF_ERROR ||
+	DGifGetWord(Private, &Image.Height) == GIF_ERROR)
 	return GIF_ERROR;
-    if (fread(Buf, 1, 1, Private->File) != 1) {
+    if (DGifRead(Private, Buf, 1) != 1) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -780,7 +804,7 @@ int DGifGetImageDesc(GifFileType *GifFile)
 
 	/* Get the image local color map: */
 	for (i = 0; i < Image.ColorMap->ColorCount; i++) {
-	    if (fread(Buf, 1, 3, Private->File) != 3) {
+	    if (DGifRead(Private, Buf, 3) != 3) {
 		_GifError = D_GIF_ERR_READ_FAILED;
 		return GIF_ERROR;
 	    }
@@ -922,7 +946,7 @@ int DGifGetExtension(GifFileType *GifFile, int *ExtCode,
 	return GIF_ERROR;
     }
 
-    if (fread(&Buf, 1, 1, Private->File) != 1) {
+    if (DGifRead(Private, &Buf, 1) != 1) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -941,14 +965,14 @@ int DGifGetExtensionNext(GifFileType *GifFile, GifByteType **Extension)
     GifByteType Buf;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
-    if (fread(&Buf, 1, 1, Private->File) != 1) {
+    if (DGifRead(Private, &Buf, 1) != 1) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
     if (Buf > 0) {
 	*Extension = Private->Buf;           /* Use private unused buffer. */
 	(*Extension)[0] = Buf;  /* Pascal strings notation (pos. 0 is len.). */
-	if (fread(&((*Extension)[1]), 1, Buf, Private->File) != Buf) {
+	if (DGifRead(Private, &((*Extension)[1]), Buf) != Buf) {
 	    _GifError = D_GIF_ERR_READ_FAILED;
 	    return GIF_ERROR;
 	}
@@ -997,14 +1021,26 @@ int DGifCloseFile(GifFileType *GifFile)
     return GIF_OK;
 }
 
+/******************************************************************************
+*   Read up to Len bytes from the given file or memory, return the count:    *
+******************************************************************************/
+static int DGifRead(GifFilePrivateType *Private, VoidPtr Buf, int Len)
+{
+    if (Private->File) return fread(Buf, 1, Len, Private->File);
+    if (Len > Private->MemEnd - Private->Mem) Len = Private->MemEnd - Private->Mem;
+    memcpy(Buf, Private->Mem, Len);
+    Private->Mem += Len;
+    return Len;
+}
+
 /******************************************************************************
 *   Get 2 bytes (word) from the given file:				      *
 ******************************************************************************/
-static int DGifGetWord(FILE *File, int *Word)
+static int DGifGetWord(GifFilePrivateType *Private, int *Word)
 {
     unsigned char c[2];
 
-    if (fread(c, 1, 2, File) != 2) {
+    if (DGifRead(Private, c, 2) != 2) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -1045,7 +1081,7 @@ int DGifGetCodeNext(GifFileType *GifFile, GifByteType **CodeBlock)
     GifByteType Buf;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
-    if (fread(&Buf, 1, 1, Private->File) != 1) {
+    if (DGifRead(Private, &Buf, 1) != 1) {
 	_GifError = D_GIF_ERR_READ_FAILED;
 	return GIF_ERROR;
     }
@@ -1053,7 +1089,7 @@ int DGifGetCodeNext(GifFileType *GifFile, GifByteType **CodeBlock)
     if (Buf > 0) {
 	*CodeBlock = Private->Buf;	       /* Use private unused buffer. */
 	(*CodeBlock)[0] = Buf;  /* Pascal strings notation (pos. 0 is len.). */
-	if (fread(&((*CodeBlock)[1]), 1, Buf, Private->File) != Buf) {
+	if (DGifRead(Private, &((*CodeBlock)[1]), Buf) != Buf) {
 	    _GifError = D_GIF_ERR_READ_FAILED;
 	    return GIF_ERROR;
 	}
@@ -1077,7 +1113,7 @@ static int DGifSetupDecompress(GifFileType *GifFile)
     unsigned int *Prefix;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
-    if (fread(&CodeSize, 1, 1, Private->File) != 1)  /* Read Code size from file. */
+    if (DGifRead(Private, &CodeSize, 1) != 1)  /* Read Code size from file. */
       return GIF_ERROR;
     BitsPerPixel = CodeSize;
 
@@ -1308,7 +1344,7 @@ static int DGifDecompressInput(GifFilePrivateType *Private, int *Code)
 
     while (Private->CrntShiftState < Private->RunningBits) {
 	/* Needs to get more bytes from input stream for next code: */
-	if (DGifBufferedInput(Private->File, Private->Buf, &NextByte)
+	if (DGifBufferedInput(Private, Private->Buf, &NextByte)
 	    == GIF_ERROR) {
 	    return GIF_ERROR;
 	}
@@ -1340,17 +1376,17 @@ static int DGifDecompressInput(GifFilePrivateType *Private, int *Code)
 *   The routine returns the next byte from its internal buffer (or read next  *
 * block in if buffer empty) and returns GIF_OK if succesful.		      *
 ******************************************************************************/
-static int DGifBufferedInput(FILE *File, GifByteType *Buf,
+static int DGifBufferedInput(GifFilePrivateType *Private, GifByteType *Buf,
 						      GifByteType *NextByte)
 {
     if (Buf[0] == 0) {
 	/* Needs to read the next buffer - this one is empty: */
-	if (fread(Buf, 1, 1, File) != 1)
+	if (DGifRead(Private, Buf, 1) != 1)
 	{
 	    _GifError = D_GIF_ERR_READ_FAILED;
 	    return GIF_ERROR;
 	}
-	if (fread(&Buf[1], 1, Buf[0], File) != Buf[0])
+	if (DGifRead(Private, &Buf[1], Buf[0]) != Buf[0])
 	{
 	    _GifError = D_GIF_ERR_READ_FAILED;
 	    return GIF_ERROR;
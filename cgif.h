@@ -137,6 +137,7 @@ GIF_EXTERN GifFileType *DGifOpenFileName(const char *GifFileName);
 GIF_EXTERN GifFileType *DGifOpenFileHandle(int GifFileHandle);
 #endif
 GIF_EXTERN GifFileType *DGifOpenFILE(void/*FILE*/ *f);
+GIF_EXTERN GifFileType *DGifOpenMem(const void *Data, unsigned long Size);
 GIF_EXTERN int DGifSlurp(GifFileType *GifFile, char do_decode_first_image_only);
 GIF_EXTERN int DGifGetScreenDesc(GifFileType *GifFile);
 GIF_EXTERN int DGifGetRecordType(GifFileType *GifFile, GifRecordType *GifType);
@@ -233,6 +234,12 @@ GIF_EXTERN void FreeExtension(SavedImage *Image);
 
 GIF_EXTERN void FreeSavedImages(GifFileType *GifFile);
 
-GIF_EXTERN int _GifError;
+/**** pts: thread-local, so that GIFs can be decoded in parallel threads */
+#ifdef __GNUC__
+#define GIF_THREAD_LOCAL __thread
+#else
+#define GIF_THREAD_LOCAL
+#endif
+GIF_EXTERN GIF_THREAD_LOCAL int _GifError;
 
 #endif /* CGIF_H */
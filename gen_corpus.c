@@ -0,0 +1,360 @@
+/*
+ * gen_corpus: deterministic synthetic image corpus for bench.sh
+ *
+ * Usage: gen_corpus <output-dir>
+ *
+ * Creates one subdirectory per category (JPEG subsampling, progressive,
+ * grayscale; PNG color type and bit depth, interlaced, tRNS; GIF plain and
+ * interlaced), each with images of a few resolutions. The pixels come from
+ * a fixed pseudorandom generator, so the files are the same on each run
+ * (given the same libjpeg and libpng versions).
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <png.h>
+#include <jpeglib.h>
+
+static const char *progname = "gen_corpus";
+
+static void check_alloc(const void *p) {
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory, aborting.\n", progname);
+		abort();
+	}
+}
+
+static FILE *open_output(const char *filename) {
+	FILE *f = fopen(filename, "wb");
+	if (!f) {
+		fprintf(stderr, "%s: can't fopen(%s): %s\n", progname, filename, strerror(errno));
+		exit(2);
+	}
+	return f;
+}
+
+static void close_output(FILE *f, const char *filename) {
+	if (ferror(f) || fclose(f) != 0) {
+		fprintf(stderr, "%s: error writing data to: %s\n", progname, filename);
+		exit(2);
+	}
+}
+
+static unsigned rng_state;
+
+static unsigned rng(void) {
+	rng_state = rng_state * 1103515245 + 12345;
+	return (rng_state >> 16) & 0x7fff;
+}
+
+/*
+ * Returns sample c (0..3) of pixel (x, y) as 0..65535: smooth gradients
+ * with some ripples and a bit of noise, so that compression ratios are
+ * similar to photos.
+ */
+static unsigned sample(unsigned x, unsigned y, unsigned c, unsigned width, unsigned height) {
+	unsigned gx = x * 65535 / width, gy = y * 65535 / height;
+	unsigned ripple = ((x / 7 + y / 5 + c * 3) & 31) << 9;
+	unsigned v;
+	switch (c) {
+	case 0: v = gx / 2 + gy / 4 + ripple; break;
+	case 1: v = gy / 2 + (65535 - gx) / 4 + ripple; break;
+	case 2: v = (gx + gy) / 4 + ripple * 2; break;
+	default: v = ((x + y) & 255) << 8;  /* Alpha. */
+	}
+	v += rng() & 1023;
+	return v > 65535 ? 65535 : v;
+}
+
+static void write_jpeg(const char *filename, unsigned width, unsigned height,
+                       unsigned components, unsigned h_samp, unsigned v_samp, int progressive) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	FILE *f = open_output(filename);
+	unsigned char *row;
+	unsigned x, y, c;
+
+	check_alloc(row = malloc(width * components));
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = components;
+	cinfo.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	if (components == 3) {
+		cinfo.comp_info[0].h_samp_factor = h_samp;
+		cinfo.comp_info[0].v_samp_factor = v_samp;
+	}
+	if (progressive) jpeg_simple_progression(&cinfo);
+	jpeg_start_compress(&cinfo, TRUE);
+	for (y = 0; y < height; ++y) {
+		for (x = 0; x < width; ++x) {
+			for (c = 0; c < components; ++c)
+				row[x * components + c] = sample(x, y, c, width, height) >> 8;
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	close_output(f, filename);
+	free(row);
+}
+
+static void write_png(const char *filename, unsigned width, unsigned height,
+                      int color_type, int bit_depth, int interlace, int trns) {
+	FILE *f = open_output(filename);
+	png_structp png_ptr;
+	png_infop info_ptr;
+	unsigned channels = color_type == PNG_COLOR_TYPE_GRAY ? 1
+	    : color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2
+	    : color_type == PNG_COLOR_TYPE_RGB ? 3
+	    : color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : 1;
+	unsigned maxval = (1U << bit_depth) - 1;
+	unsigned row_bytes = (width * channels * bit_depth + 7) / 8;
+	unsigned char *row;
+	unsigned x, y, c, v, bitpos;
+	int pass, passes;
+
+	check_alloc(row = malloc(row_bytes));
+	check_alloc(png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL));
+	check_alloc(info_ptr = png_create_info_struct(png_ptr));
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "%s: libpng error writing: %s\n", progname, filename);
+		exit(2);
+	}
+	png_init_io(png_ptr, f);
+	png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+	             interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+	             PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		png_color palette[256];
+		png_byte trans_alpha[256];
+		unsigned i, n = 1U << bit_depth;
+		for (i = 0; i < n; ++i) {
+			palette[i].red = i * 255 / (n - 1);
+			palette[i].green = (i * 97) & 255;
+			palette[i].blue = 255 - i * 255 / (n - 1);
+			trans_alpha[i] = i * 255 / (n - 1);
+		}
+		png_set_PLTE(png_ptr, info_ptr, palette, n);
+		if (trns) png_set_tRNS(png_ptr, info_ptr, trans_alpha, n, NULL);
+	} else if (trns) {
+		png_color_16 trans_color;
+		memset(&trans_color, 0, sizeof(trans_color));
+		trans_color.gray = trans_color.red = trans_color.green = trans_color.blue = maxval / 2;
+		png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trans_color);
+	}
+	png_write_info(png_ptr, info_ptr);
+	passes = interlace ? png_set_interlace_handling(png_ptr) : 1;
+	for (pass = 0; pass < passes; ++pass) {
+		rng_state = 1;  /* Each pass gets the same rows. */
+		for (y = 0; y < height; ++y) {
+			memset(row, 0, row_bytes);
+			bitpos = 0;
+			for (x = 0; x < width; ++x) {
+				for (c = 0; c < channels; ++c) {
+					/* The alpha channel is always the last one. */
+					v = sample(x, y, c + 1 == channels && (color_type & PNG_COLOR_MASK_ALPHA) ? 3 : c, width, height);
+					v >>= 16 - bit_depth;
+					if (bit_depth == 16) {
+						row[bitpos / 8] = v >> 8;
+						row[bitpos / 8 + 1] = v;
+					} else {
+						row[bitpos / 8] |= v << (8 - bit_depth - bitpos % 8);
+					}
+					bitpos += bit_depth;
+				}
+			}
+			png_write_row(png_ptr, row);
+		}
+	}
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	close_output(f, filename);
+	free(row);
+}
+
+/* --- GIF writer with 8-bit LZW compression. */
+
+struct gif_writer {
+	FILE *f;
+	unsigned acc, nbits;  /* Bit accumulator. */
+	unsigned char block[255];
+	unsigned block_size;
+};
+
+static void gif_put_code(struct gif_writer *gw, unsigned code, unsigned code_size) {
+	gw->acc |= code << gw->nbits;
+	gw->nbits += code_size;
+	while (gw->nbits >= 8) {
+		gw->block[gw->block_size++] = gw->acc & 255;
+		gw->acc >>= 8;
+		gw->nbits -= 8;
+		if (gw->block_size == 255) {
+			putc(255, gw->f);
+			fwrite(gw->block, 1, 255, gw->f);
+			gw->block_size = 0;
+		}
+	}
+}
+
+static void write_gif(const char *filename, unsigned width, unsigned height, int interlace) {
+	static const unsigned pass_start[4] = { 0, 4, 2, 1 }, pass_step[4] = { 8, 8, 4, 2 };
+	struct gif_writer gw;
+	unsigned short *next;  /* next[code * 256 + pixel]: code of the extended string, or 0. */
+	unsigned char header[13] = { 'G', 'I', 'F', '8', '9', 'a', 0, 0, 0, 0, 0xf7, 0, 0 };
+	unsigned char descriptor[10] = { ',', 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned i, x, y, pass, pixel, prefix = 0, has_prefix = 0;
+	unsigned max_code = 257, code_size = 9;  /* After the clear and end codes. */
+
+	gw.f = open_output(filename);
+	gw.acc = gw.nbits = gw.block_size = 0;
+	check_alloc(next = calloc(4096 * 256, sizeof(unsigned short)));
+	header[6] = width & 255; header[7] = width >> 8;
+	header[8] = height & 255; header[9] = height >> 8;
+	fwrite(header, 1, sizeof(header), gw.f);
+	for (i = 0; i < 256; ++i) {  /* 6x6x6 color cube and grays. */
+		unsigned char rgb[3];
+		if (i < 216) {
+			rgb[0] = i / 36 * 51; rgb[1] = i / 6 % 6 * 51; rgb[2] = i % 6 * 51;
+		} else {
+			rgb[0] = rgb[1] = rgb[2] = (i - 216) * 255 / 39;
+		}
+		fwrite(rgb, 1, 3, gw.f);
+	}
+	descriptor[5] = width & 255; descriptor[6] = width >> 8;
+	descriptor[7] = height & 255; descriptor[8] = height >> 8;
+	descriptor[9] = interlace ? 0x40 : 0;
+	fwrite(descriptor, 1, sizeof(descriptor), gw.f);
+	putc(8, gw.f);  /* LZW minimum code size. */
+	gif_put_code(&gw, 256, code_size);  /* Clear code. */
+	for (pass = 0; pass < (interlace ? 4U : 1U); ++pass) {
+		for (y = interlace ? pass_start[pass] : 0; y < height; y += interlace ? pass_step[pass] : 1) {
+			rng_state = y + 1;  /* Same rows independently of the pass order. */
+			for (x = 0; x < width; ++x) {
+				pixel = sample(x, y, 0, width, height) * 6 / 65536 * 36 +
+				    sample(x, y, 1, width, height) * 6 / 65536 * 6 +
+				    sample(x, y, 2, width, height) * 6 / 65536;
+				if (!has_prefix) {
+					prefix = pixel;
+					has_prefix = 1;
+				} else if (next[prefix * 256 + pixel]) {
+					prefix = next[prefix * 256 + pixel];
+				} else {
+					gif_put_code(&gw, prefix, code_size);
+					next[prefix * 256 + pixel] = ++max_code;
+					if (max_code >= 1U << code_size) ++code_size;
+					if (max_code == 4095) {  /* Dictionary full, start again. */
+						gif_put_code(&gw, 256, code_size);
+						memset(next, 0, 4096 * 256 * sizeof(unsigned short));
+						max_code = 257;
+						code_size = 9;
+					}
+					prefix = pixel;
+				}
+			}
+		}
+	}
+	if (has_prefix) gif_put_code(&gw, prefix, code_size);
+	gif_put_code(&gw, 257, code_size);  /* End of information. */
+	if (gw.nbits > 0) gif_put_code(&gw, 0, 8 - gw.nbits);
+	if (gw.block_size > 0) {
+		putc(gw.block_size, gw.f);
+		fwrite(gw.block, 1, gw.block_size, gw.f);
+	}
+	putc(0, gw.f);
+	putc(';', gw.f);
+	close_output(gw.f, filename);
+	free(next);
+}
+
+/* --- */
+
+enum kind { K_JPEG, K_PNG, K_GIF };
+
+static const struct category {
+	const char *name;
+	enum kind kind;
+	/* JPEG: components, h_samp, v_samp, progressive.
+	 * PNG: color_type, bit_depth, interlace, trns.
+	 * GIF: interlace.
+	 */
+	int a, b, c, d;
+} categories[] = {
+	{ "jpeg_420", K_JPEG, 3, 2, 2, 0 },
+	{ "jpeg_422", K_JPEG, 3, 2, 1, 0 },
+	{ "jpeg_444", K_JPEG, 3, 1, 1, 0 },
+	{ "jpeg_420_progressive", K_JPEG, 3, 2, 2, 1 },
+	{ "jpeg_gray", K_JPEG, 1, 1, 1, 0 },
+	{ "png_gray1", K_PNG, PNG_COLOR_TYPE_GRAY, 1, 0, 0 },
+	{ "png_gray2", K_PNG, PNG_COLOR_TYPE_GRAY, 2, 0, 0 },
+	{ "png_gray4", K_PNG, PNG_COLOR_TYPE_GRAY, 4, 0, 0 },
+	{ "png_gray8", K_PNG, PNG_COLOR_TYPE_GRAY, 8, 0, 0 },
+	{ "png_gray16", K_PNG, PNG_COLOR_TYPE_GRAY, 16, 0, 0 },
+	{ "png_gray8_trns", K_PNG, PNG_COLOR_TYPE_GRAY, 8, 0, 1 },
+	{ "png_gray_alpha8", K_PNG, PNG_COLOR_TYPE_GRAY_ALPHA, 8, 0, 0 },
+	{ "png_gray_alpha16", K_PNG, PNG_COLOR_TYPE_GRAY_ALPHA, 16, 0, 0 },
+	{ "png_rgb8", K_PNG, PNG_COLOR_TYPE_RGB, 8, 0, 0 },
+	{ "png_rgb16", K_PNG, PNG_COLOR_TYPE_RGB, 16, 0, 0 },
+	{ "png_rgb8_trns", K_PNG, PNG_COLOR_TYPE_RGB, 8, 0, 1 },
+	{ "png_rgb8_interlaced", K_PNG, PNG_COLOR_TYPE_RGB, 8, 1, 0 },
+	{ "png_rgba8", K_PNG, PNG_COLOR_TYPE_RGB_ALPHA, 8, 0, 0 },
+	{ "png_rgba16", K_PNG, PNG_COLOR_TYPE_RGB_ALPHA, 16, 0, 0 },
+	{ "png_palette1", K_PNG, PNG_COLOR_TYPE_PALETTE, 1, 0, 0 },
+	{ "png_palette2", K_PNG, PNG_COLOR_TYPE_PALETTE, 2, 0, 0 },
+	{ "png_palette4", K_PNG, PNG_COLOR_TYPE_PALETTE, 4, 0, 0 },
+	{ "png_palette8", K_PNG, PNG_COLOR_TYPE_PALETTE, 8, 0, 0 },
+	{ "png_palette8_trns", K_PNG, PNG_COLOR_TYPE_PALETTE, 8, 0, 1 },
+	{ "png_palette8_interlaced", K_PNG, PNG_COLOR_TYPE_PALETTE, 8, 1, 1 },
+	{ "gif", K_GIF, 0, 0, 0, 0 },
+	{ "gif_interlaced", K_GIF, 1, 0, 0, 0 },
+};
+
+/* Resolutions of the images in each category. */
+static const unsigned jpeg_sizes[][2] = { { 640, 480 }, { 1600, 1200 }, { 2592, 1944 }, { 4000, 3000 } };
+static const unsigned png_sizes[][2] = { { 640, 480 }, { 1024, 768 }, { 1600, 1200 }, { 2048, 1536 } };
+
+int main(int argc, char **argv) {
+	char filename[4096];
+	unsigned i, j;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <output-dir>\n", argv[0]);
+		return 1;
+	}
+	if (mkdir(argv[1], 0777) != 0 && errno != EEXIST) {
+		fprintf(stderr, "%s: can't mkdir(%s): %s\n", progname, argv[1], strerror(errno));
+		return 2;
+	}
+	for (i = 0; i < sizeof(categories) / sizeof(categories[0]); ++i) {
+		const struct category *cat = categories + i;
+		snprintf(filename, sizeof(filename), "%s/%s", argv[1], cat->name);
+		if (mkdir(filename, 0777) != 0 && errno != EEXIST) {
+			fprintf(stderr, "%s: can't mkdir(%s): %s\n", progname, filename, strerror(errno));
+			return 2;
+		}
+		for (j = 0; j < 4; ++j) {
+			const unsigned *size = cat->kind == K_JPEG ? jpeg_sizes[j] : png_sizes[j];
+			snprintf(filename, sizeof(filename), "%s/%s/%ux%u.%s", argv[1], cat->name,
+			         size[0], size[1], cat->kind == K_JPEG ? "jpg" : cat->kind == K_PNG ? "png" : "gif");
+			rng_state = 1;
+			if (cat->kind == K_JPEG) {
+				write_jpeg(filename, size[0], size[1], cat->a, cat->b, cat->c, cat->d);
+			} else if (cat->kind == K_PNG) {
+				write_png(filename, size[0], size[1], cat->a, cat->b, cat->c, cat->d);
+			} else {
+				write_gif(filename, size[0], size[1], cat->a);
+			}
+		}
+		printf("%s\n", cat->name);
+	}
+	return 0;
+}
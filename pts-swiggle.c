@@ -44,10 +44,16 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -66,15 +72,79 @@
 
 #include "cgif.h"
 
+/* libjpeg v7+ and libjpeg-turbo >= 1.5 can decode at any M/8 scale (M = 1..16), older
+ * versions only at 1/1, 1/2, 1/4 and 1/8. Compile with -DNO_JPEG_M8_SCALE to use the latter.
+ */
+#if (JPEG_LIB_VERSION >= 70 || defined(LIBJPEG_TURBO_VERSION_NUMBER)) && !defined(NO_JPEG_M8_SCALE)
+#define USE_JPEG_M8_SCALE 1
+#endif
+
 #define	SWIGGLE_VERSION	"0.4-pts"
 
+/* --draft uses the DCT scale nearest to -H if its height is at most this far from it. */
+#define DRAFT_MAX_DEVIATION_PERCENT 5
+
+/* Maximum number of thumbnail heights in -H. */
+#define MAX_THUMBNAIL_SIZES 8
+
+/* Room for the longest ".th<height>.jpg" suffix of thumbnail filenames, with the trailing NUL. */
+#define THUMBNAIL_SUFFIX_SIZE 18
+
+/* --max-bytes compresses each thumbnail at most this many times. */
+#ifndef MAX_QUALITY_ATTEMPTS
+#define MAX_QUALITY_ATTEMPTS 8
+#endif
+
+/* Resampling filters (-k), used unless -l is specified. */
+enum resize_filter { RF_BOX, RF_TRIANGLE, RF_CATMULL_ROM, RF_LANCZOS3 };
+
+typedef enum imgfmt_t {
+  IF_UNKNOWN = 0,
+  IF_JPEG = 1,
+  IF_PNG = 2,
+  IF_GIF = 3,
+} imgfmt_t;
+
+/*
+ * An input file, with what scan_dir (or main) already knows about it, so
+ * that creating the thumbnail doesn't repeat those syscalls.
+ */
+struct input_entry {
+	char *filename;
+	struct stat sb;
+	char has_stat;  /* Is sb set? */
+	int fd;  /* Opened by scan_dir, or -1. If >= 0, has_stat is true. */
+	imgfmt_t format;  /* Detected by scan_dir, or IF_UNKNOWN. */
+};
+
+static const char *const resize_filter_names[] = { "box", "triangle", "catmull-rom", "lanczos3", NULL };
+
 static struct {
 	char *progname;
-	int scaleheight;
+	/* Thumbnail heights (-H), largest first. With more than one, each
+	 * thumbnail filename contains its height.
+	 */
+	int scaleheights[MAX_THUMBNAIL_SIZES];
+	unsigned nscaleheights;
 	int force;
 	int bilinear;
+	int float_resize;  /* Use the double precision resize functions (-F). */
+	int filter;  /* enum resize_filter (-k). */
+	int stats;  /* Print timing statistics at exit (--stats). */
+	int draft;  /* Fast, lower quality JPEG decoding (--draft). */
+	int no_embedded;  /* Don't decode EXIF or MPF embedded JPEG images (--no-embedded). */
+	int partial_progressive;  /* Decode only the early scans of progressive JPEGs (--partial-progressive). */
+	int no_raw;  /* Convert JPEG images to RGB rather than resizing YCbCr planes (--no-raw). */
+	int no_sniff;  /* Trust the extensions of regular files in directories (--no-sniff). */
+	int full_interlaced;  /* Decode all Adam7 passes of interlaced PNGs (--full-interlaced). */
+	int detect_gray;  /* Make gray thumbnails of RGB PNG and GIF images with only gray pixels (--detect-gray). */
+	int quality;  /* JPEG quality of the thumbnails (-q); the maximum with --max-bytes. */
+	long max_bytes;  /* Size limit of the thumbnail files (--max-bytes), or 0. */
 	int recursive;
 	int also_small;
+	int jobs;  /* Number of images processed in parallel (-j). */
+	int pipeline;  /* Run decode, resize and encode in separate threads (-P). */
+	int stream;  /* Resize JPEG and PNG scanlines while decoding them (-S). */
 	/* Bitwise or of:
 	 * 1: Invalid command-line flags or arguments.
 	 * 2: File not found, I/O error, runtime error or abnormal condition.
@@ -82,23 +152,29 @@ static struct {
 	 * 8: File specified on the command-line is not an image.
 	 */
 	int exit_code;
-} g_flags = { "", 480, 0, 0, 0, 0, EXIT_SUCCESS /* 0 */ };
+} g_flags = { "", { 480 }, 1, 0, 0, 0, RF_BOX, 0, 0, 0, 0, 0, 0, 0, 0, 50, 0, 0, 0, 0, 0, 0, EXIT_SUCCESS /* 0 */ };
 
 /*
  * Function declarations.
  */
 static void process_dir(char *);
+static void process_files(struct input_entry *, unsigned);
+static char pipeline_init(unsigned);
 static int check_cache(char *, struct stat *);
-static void create_thumbnail(char *);
+static char is_thumbnail_filename(const char *);
+static void create_thumbnail(struct input_entry *);
 static int sort_by_filename(const void *, const void *);
 static void usage(void);
 static void version(void);
-static void resize_bicubic(
-    unsigned num_components, unsigned output_width, unsigned output_height,
-    unsigned, unsigned, const unsigned char *, unsigned char *);
-static void resize_bilinear(
-    unsigned num_components, unsigned output_width, unsigned output_height,
-    unsigned, unsigned, const unsigned char *, unsigned char *);
+static void select_resize_ops(void);
+static void stats_init(void);
+static void print_stats(void);
+struct resize_io;
+static void resize_bicubic(const struct resize_io *, unsigned, unsigned);
+static void resize_bilinear(const struct resize_io *, unsigned, unsigned);
+static void resize_separable(const struct resize_io *, unsigned, unsigned);
+static unsigned resize_window_rows(unsigned, unsigned);
+static void resize_bilinear_fixed(const struct resize_io *, unsigned, unsigned);
 
 static void check_alloc(const void *p) {
 	if (!p) {
@@ -108,8 +184,272 @@ static void check_alloc(const void *p) {
 	}
 }
 
+/* Thread-safe version of g_flags.exit_code |= code. */
+static void add_exit_code(int code) {
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&mutex);
+	g_flags.exit_code |= code;
+	pthread_mutex_unlock(&mutex);
+}
+
+/* --- Worker thread pool */
+
+/*
+ * The pool is a work-stealing scheduler: each thread has its own deque of
+ * tasks. A thread pushes the tasks it submits to the bottom of its own
+ * deque, and takes tasks from the bottom of it (LIFO). When that is
+ * empty, it steals the oldest task from the top of another deque (FIFO),
+ * so idle threads pick up big pieces of work, e.g. whole directories.
+ */
+
+struct task_group {
+	unsigned pending;  /* Number of unfinished tasks. Protected by g_pool.mutex. */
+};
+
+struct task {
+	void (*func)(void *arg);
+	void *arg;
+	struct task_group *group;
+};
+
+/* Growable ring buffer of tasks, used as a double-ended queue. */
+struct deque {
+	pthread_mutex_t mutex;
+	struct task **items;
+	unsigned capacity, first, count;
+};
+
+static struct {
+	pthread_mutex_t mutex;  /* Protects queued and task_group.pending. */
+	pthread_cond_t wakeup;  /* Broadcast when a task is queued or finished. */
+	/* Total number of tasks in the deques, or being pushed to them. Counted
+	 * before the push, so that a thief can't decrement it below 0.
+	 */
+	unsigned queued;
+	/* The last deque is used by threads outside the pool, e.g. main. */
+	struct deque *deques;
+	unsigned ndeques;
+	unsigned nthreads;  /* 0 means that tasks are run by pool_submit. */
+} g_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, 0, 0 };
+
+/* 1 + index of the deque of the current worker thread, or 0. */
+static __thread unsigned tls_deque_index;
+
+static struct deque *own_deque(void) {
+	return g_pool.deques + (tls_deque_index ? tls_deque_index : g_pool.ndeques) - 1;
+}
+
+static void deque_push_bottom(struct deque *d, struct task *t) {
+	pthread_mutex_lock(&d->mutex);
+	if (d->count == d->capacity) {
+		struct task **items;
+		unsigned i;
+		const unsigned capacity = d->capacity < 16 ? 16 : d->capacity << 1;
+		check_alloc(items = malloc(capacity * sizeof(*items)));
+		for (i = 0; i < d->count; ++i) {
+			items[i] = d->items[(d->first + i) % d->capacity];
+		}
+		free(d->items);
+		d->items = items;
+		d->capacity = capacity;
+		d->first = 0;
+	}
+	d->items[(d->first + d->count++) % d->capacity] = t;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static struct task *deque_pop_bottom(struct deque *d) {
+	struct task *t = NULL;
+	pthread_mutex_lock(&d->mutex);
+	if (d->count != 0) t = d->items[(d->first + --d->count) % d->capacity];
+	pthread_mutex_unlock(&d->mutex);
+	return t;
+}
+
+static struct task *deque_steal_top(struct deque *d) {
+	struct task *t = NULL;
+	pthread_mutex_lock(&d->mutex);
+	if (d->count != 0) {
+		t = d->items[d->first];
+		d->first = (d->first + 1) % d->capacity;
+		--d->count;
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return t;
+}
+
+/* Takes a task from the own deque, or steals one. Returns NULL if none. */
+static struct task *pool_take(void) {
+	struct deque *own;
+	struct task *t;
+	unsigned i, j;
+	if (g_pool.ndeques == 0) return NULL;
+	own = own_deque();
+	t = deque_pop_bottom(own);
+	j = own - g_pool.deques;
+	for (i = 1; !t && i < g_pool.ndeques; ++i) {
+		t = deque_steal_top(g_pool.deques + (j + i) % g_pool.ndeques);
+	}
+	if (t) {
+		pthread_mutex_lock(&g_pool.mutex);
+		--g_pool.queued;
+		pthread_mutex_unlock(&g_pool.mutex);
+	}
+	return t;
+}
+
+static void pool_run(struct task *t) {
+	t->func(t->arg);
+	pthread_mutex_lock(&g_pool.mutex);
+	--t->group->pending;
+	pthread_cond_broadcast(&g_pool.wakeup);
+	pthread_mutex_unlock(&g_pool.mutex);
+	free(t);
+}
+
+static void *pool_worker(void *arg) {
+	struct task *t;
+	tls_deque_index = (unsigned)(size_t)arg;
+	for (;;) {
+		if ((t = pool_take()) != NULL) {
+			pool_run(t);
+		} else {
+			pthread_mutex_lock(&g_pool.mutex);
+			while (g_pool.queued == 0)
+				pthread_cond_wait(&g_pool.wakeup, &g_pool.mutex);
+			pthread_mutex_unlock(&g_pool.mutex);
+		}
+	}
+	return NULL;  /* Not reached. */
+}
+
+/* Starts nthreads - 1 worker threads. The thread calling pool_wait is the
+ * remaining one.
+ */
+static void pool_init(unsigned nthreads) {
+	pthread_t thread;
+	unsigned i, started;
+	int err;
+	check_alloc(g_pool.deques = malloc(nthreads * sizeof(*g_pool.deques)));
+	for (i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&g_pool.deques[i].mutex, NULL);
+		g_pool.deques[i].items = NULL;
+		g_pool.deques[i].capacity = g_pool.deques[i].first = g_pool.deques[i].count = 0;
+	}
+	g_pool.ndeques = nthreads;
+	for (started = 0; started + 1 < nthreads; ++started) {
+		if ((err = pthread_create(&thread, NULL, pool_worker, (void*)(size_t)(started + 1))) != 0) {
+			fprintf(stderr, "%s: can't create thread: %s\n", g_flags.progname, strerror(err));
+			break;  /* With 0 threads, run everything serially. */
+		}
+		pthread_detach(thread);
+	}
+	g_pool.nthreads = started;
+}
+
+/* Adds func(arg) to the own deque. Without worker threads, runs it now. */
+static void pool_submit(struct task_group *group, void (*func)(void *arg), void *arg) {
+	struct task *t;
+	if (g_pool.nthreads == 0) {
+		func(arg);
+		return;
+	}
+	check_alloc(t = malloc(sizeof(*t)));
+	t->func = func;
+	t->arg = arg;
+	t->group = group;
+	pthread_mutex_lock(&g_pool.mutex);
+	++group->pending;
+	++g_pool.queued;
+	pthread_mutex_unlock(&g_pool.mutex);
+	deque_push_bottom(own_deque(), t);
+	pthread_mutex_lock(&g_pool.mutex);
+	pthread_cond_broadcast(&g_pool.wakeup);
+	pthread_mutex_unlock(&g_pool.mutex);
+}
+
+/* Adds a task to group which is not run by the pool. */
+static void task_group_add(struct task_group *group) {
+	pthread_mutex_lock(&g_pool.mutex);
+	++group->pending;
+	pthread_mutex_unlock(&g_pool.mutex);
+}
+
+/* Marks a task added by task_group_add as finished. */
+static void task_group_done(struct task_group *group) {
+	pthread_mutex_lock(&g_pool.mutex);
+	--group->pending;
+	pthread_cond_broadcast(&g_pool.wakeup);
+	pthread_mutex_unlock(&g_pool.mutex);
+}
+
+/* Waits for all tasks of group to finish, running queued tasks meanwhile. */
+static void pool_wait(struct task_group *group) {
+	struct task *t;
+	pthread_mutex_lock(&g_pool.mutex);
+	while (group->pending != 0) {
+		pthread_mutex_unlock(&g_pool.mutex);
+		if ((t = pool_take()) != NULL) {
+			pool_run(t);
+			pthread_mutex_lock(&g_pool.mutex);
+			continue;
+		}
+		pthread_mutex_lock(&g_pool.mutex);
+		while (group->pending != 0 && g_pool.queued == 0)
+			pthread_cond_wait(&g_pool.wakeup, &g_pool.mutex);
+	}
+	pthread_mutex_unlock(&g_pool.mutex);
+}
+
 /* --- */
 
+#define OPT_STATS 256  /* Long options only, outside the char range. */
+#define OPT_DRAFT 257
+#define OPT_NO_EMBEDDED 258
+#define OPT_PARTIAL_PROGRESSIVE 259
+#define OPT_NO_RAW 260
+#define OPT_NO_SNIFF 261
+#define OPT_MAX_BYTES 262
+#define OPT_FULL_INTERLACED 263
+#define OPT_DETECT_GRAY 264
+
+static const struct option long_options[] = {
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ "draft", no_argument, NULL, OPT_DRAFT },
+	{ "no-embedded", no_argument, NULL, OPT_NO_EMBEDDED },
+	{ "partial-progressive", no_argument, NULL, OPT_PARTIAL_PROGRESSIVE },
+	{ "no-raw", no_argument, NULL, OPT_NO_RAW },
+	{ "no-sniff", no_argument, NULL, OPT_NO_SNIFF },
+	{ "max-bytes", required_argument, NULL, OPT_MAX_BYTES },
+	{ "full-interlaced", no_argument, NULL, OPT_FULL_INTERLACED },
+	{ "detect-gray", no_argument, NULL, OPT_DETECT_GRAY },
+	{ NULL, 0, NULL, 0 },
+};
+
+static int sort_heights_decreasing(const void *a, const void *b) {
+	const int ha = *(const int*)a, hb = *(const int*)b;
+	return ha > hb ? -1 : ha < hb;
+}
+
+/* Parses the comma-separated list of -H to g_flags.scaleheights. Returns 0 on error. */
+static char parse_scaleheights(const char *arg) {
+	char *eptr;
+	unsigned i, n = 0;
+	for (;;) {
+		if (n == MAX_THUMBNAIL_SIZES) return 0;
+		g_flags.scaleheights[n] = (int) strtol(arg, &eptr, 10);
+		if (eptr == arg || g_flags.scaleheights[n++] < 1) return 0;
+		if (*eptr == '\0') break;
+		if (*eptr != ',') return 0;
+		arg = eptr + 1;
+	}
+	qsort(g_flags.scaleheights, n, sizeof(g_flags.scaleheights[0]), sort_heights_decreasing);
+	for (g_flags.nscaleheights = i = 1; i < n; ++i) {  /* Remove duplicates. */
+		if (g_flags.scaleheights[i] != g_flags.scaleheights[g_flags.nscaleheights - 1])
+			g_flags.scaleheights[g_flags.nscaleheights++] = g_flags.scaleheights[i];
+	}
+	return 1;
+}
 
 /*
  * swiggle generates a web image gallery. It scales down images in
@@ -120,12 +460,14 @@ int
 main(int argc, char **argv)
 {
 	char *eptr;
-	int i;
+	int i, filter;
 	struct stat sb;
+	struct input_entry *files;
+	unsigned filecount;
 
 	g_flags.progname = argv[0];
 
-	while ((i = getopt(argc, argv, "c:d:h:H:r:s:floRva")) != -1) {
+	while ((i = getopt_long(argc, argv, "c:d:h:H:j:k:q:r:s:fFloPRSva", long_options, NULL)) != -1) {
 		switch (i) {
 		case 'c':  /* cols, ignored */
 			break;
@@ -134,14 +476,80 @@ main(int argc, char **argv)
 		case 'h':  /* thumbheight, ignored */
 			break;
 		case 'H':
-			g_flags.scaleheight = (int) strtol(optarg, &eptr, 10);
-			if (eptr == optarg || *eptr != '\0') {
+			if (!parse_scaleheights(optarg)) {
 				fprintf(stderr, "%s: invalid argument '-H "
 				    "%s'\n", g_flags.progname, optarg);
 				usage();
 				exit(EXIT_FAILURE);  /* 1 */
 			}
 			break;
+		case 'j':
+			g_flags.jobs = (int) strtol(optarg, &eptr, 10);
+			if (eptr == optarg || *eptr != '\0' || g_flags.jobs < 1) {
+				fprintf(stderr, "%s: invalid argument '-j "
+				    "%s'\n", g_flags.progname, optarg);
+				usage();
+				exit(EXIT_FAILURE);  /* 1 */
+			}
+			break;
+		case 'k':
+			for (filter = 0; resize_filter_names[filter] && 0 != strcmp(resize_filter_names[filter], optarg); ++filter) {}
+			if (!resize_filter_names[filter]) {
+				fprintf(stderr, "%s: invalid argument '-k "
+				    "%s'\n", g_flags.progname, optarg);
+				usage();
+				exit(EXIT_FAILURE);  /* 1 */
+			}
+			g_flags.filter = filter;
+			break;
+		case 'q':
+			g_flags.quality = (int) strtol(optarg, &eptr, 10);
+			if (eptr == optarg || *eptr != '\0' || g_flags.quality < 1 || g_flags.quality > 100) {
+				fprintf(stderr, "%s: invalid argument '-q "
+				    "%s'\n", g_flags.progname, optarg);
+				usage();
+				exit(EXIT_FAILURE);  /* 1 */
+			}
+			break;
+		case 'P':
+			g_flags.pipeline = 1;
+			break;
+		case OPT_STATS:
+			g_flags.stats = 1;
+			break;
+		case OPT_DRAFT:
+			g_flags.draft = 1;
+			break;
+		case OPT_NO_EMBEDDED:
+			g_flags.no_embedded = 1;
+			break;
+		case OPT_PARTIAL_PROGRESSIVE:
+			g_flags.partial_progressive = 1;
+			break;
+		case OPT_NO_RAW:
+			g_flags.no_raw = 1;
+			break;
+		case OPT_NO_SNIFF:
+			g_flags.no_sniff = 1;
+			break;
+		case OPT_FULL_INTERLACED:
+			g_flags.full_interlaced = 1;
+			break;
+		case OPT_DETECT_GRAY:
+			g_flags.detect_gray = 1;
+			break;
+		case OPT_MAX_BYTES:
+			g_flags.max_bytes = strtol(optarg, &eptr, 10);
+			if (eptr == optarg || *eptr != '\0' || g_flags.max_bytes < 1) {
+				fprintf(stderr, "%s: invalid argument '--max-bytes "
+				    "%s'\n", g_flags.progname, optarg);
+				usage();
+				exit(EXIT_FAILURE);  /* 1 */
+			}
+			break;
+		case 'S':
+			g_flags.stream = 1;
+			break;
 		case 'R':
 			g_flags.recursive = 1;
 			break;
@@ -150,6 +558,9 @@ main(int argc, char **argv)
 		case 'f':
 			g_flags.force = 1;
 			break;
+		case 'F':
+			g_flags.float_resize = 1;
+			break;
 		case 'l':
 			g_flags.bilinear = 1;
 			break;
@@ -177,41 +588,64 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);  /* 1 */
 	}
 
+	if (g_flags.jobs == 0) {  /* Default: number of online CPUs. */
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		g_flags.jobs = ncpus > 0 ? ncpus : 1;
+	}
+	/*
+	 * --max-bytes compresses the resized pixels several times, and the
+	 * smaller sizes of -H are resized from the larger ones, so they need
+	 * them in memory.
+	 */
+	if (g_flags.max_bytes || g_flags.nscaleheights > 1) g_flags.stream = 0;
+	select_resize_ops();
+	stats_init();
+	if (g_flags.pipeline) {
+		g_flags.pipeline = pipeline_init(g_flags.jobs);
+	} else {
+		pool_init(g_flags.jobs);
+	}
+
 	/* Put the inputs to increasing order for deterministic processing. */
 	qsort(argv, argc, sizeof argv[0], sort_by_filename);
 
+	/* Consecutive regular files are collected to files, and processed together. */
+	check_alloc(files = malloc(argc * sizeof(*files)));
+	filecount = 0;
 	for (i = 0; i < argc; ++i) {
 		if (stat(argv[i], &sb)) {
 			fprintf(stderr, "%s: can't stat(%s): %s\n", g_flags.progname, argv[i],
 			    strerror(errno));
-			g_flags.exit_code |= 2;
+			add_exit_code(2);
 			continue;
 		}
 
 		if (S_ISDIR(sb.st_mode)) {
 			if (argv[i][strlen(argv[i])-1] == '/')
 				argv[i][strlen(argv[i])-1] = '\0';
+			process_files(files, filecount);
+			filecount = 0;
 			process_dir(argv[i]);
 		} else if (S_ISREG(sb.st_mode)) {
-			create_thumbnail(argv[i]);
+			files[filecount].filename = argv[i];
+			files[filecount].sb = sb;
+			files[filecount].has_stat = 1;
+			files[filecount].fd = -1;
+			files[filecount++].format = IF_UNKNOWN;
 		} else {
 			fprintf(stderr, "%s: not a file or directory: %s\n", g_flags.progname,
 			    argv[i]);
-			g_flags.exit_code |= 2;
+			add_exit_code(2);
 		}
 
 	}
+	process_files(files, filecount);
+	free(files);
 
+	if (g_flags.stats) print_stats();
 	return g_flags.exit_code;
 }
 
-typedef enum imgfmt_t {
-  IF_UNKNOWN = 0,
-  IF_JPEG = 1,
-  IF_PNG = 2,
-  IF_GIF = 3,
-} imgfmt_t;
-
 static imgfmt_t detect_image_format(const char *header, unsigned header_size) {
 	return header_size >= 4 && 0 == memcmp(header, "\xff\xd8\xff", 3) ? IF_JPEG
 	     : header_size >= 24 && 0 == memcmp(header, "\211PNG\r\n\032\n", 8) ? IF_PNG
@@ -219,33 +653,110 @@ static imgfmt_t detect_image_format(const char *header, unsigned header_size) {
 	     : IF_UNKNOWN;
 }
 
+/* Returns whether filename has the extension of an image format we can read. */
+static char has_image_extension(const char *filename) {
+	static const char *const exts[] = { ".jpg", ".jpeg", ".jpe", ".png", ".gif", NULL };
+	const char *const *ext;
+	size_t size = strlen(filename), ext_size, i;
+	for (ext = exts; *ext; ++ext) {
+		ext_size = strlen(*ext);
+		if (size <= ext_size) continue;
+		for (i = 0; i < ext_size && tolower((unsigned char)filename[size - ext_size + i]) == (*ext)[i]; ++i) {}
+		if (i == ext_size) return 1;
+	}
+	return 0;
+}
+
+/*
+ * scan_dir keeps the files it has sniffed open for creating the thumbnail,
+ * but at most this many at a time (and at most 1/4 of RLIMIT_NOFILE), so
+ * that large directories don't run out of file descriptors.
+ */
+#ifndef MAX_SCANNED_OPEN_FILES
+#define MAX_SCANNED_OPEN_FILES 256
+#endif
+
+static struct {
+	pthread_mutex_t mutex;
+	unsigned count;
+	unsigned limit;  /* 0 if not computed yet. */
+} g_scanned_fds = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+
+/* Returns whether scan_dir may keep one more file open, and counts it if so. */
+static char reserve_scanned_fd(void) {
+	struct rlimit rl;
+	char result;
+	pthread_mutex_lock(&g_scanned_fds.mutex);
+	if (g_scanned_fds.limit == 0) {
+		g_scanned_fds.limit = MAX_SCANNED_OPEN_FILES + 1;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+		    rl.rlim_cur / 4 < g_scanned_fds.limit) {
+			g_scanned_fds.limit = rl.rlim_cur / 4 + 1;
+		}
+	}
+	result = g_scanned_fds.count + 1 < g_scanned_fds.limit;
+	g_scanned_fds.count += result;
+	pthread_mutex_unlock(&g_scanned_fds.mutex);
+	return result;
+}
+
+/* Returns entry->fd (or -1), which the caller has to close. */
+static int take_entry_fd(struct input_entry *entry) {
+	const int fd = entry->fd;
+	if (fd < 0) return fd;
+	entry->fd = -1;
+	pthread_mutex_lock(&g_scanned_fds.mutex);
+	--g_scanned_fds.count;
+	pthread_mutex_unlock(&g_scanned_fds.mutex);
+	return fd;
+}
+
+static void close_entry_fd(struct input_entry *entry) {
+	const int fd = take_entry_fd(entry);
+	if (fd >= 0) close(fd);
+}
+
+static void free_input_entries(struct input_entry *entries, unsigned count) {
+	unsigned i;
+	for (i = 0; i < count; ++i) {
+		close_entry_fd(entries + i);
+		free(entries[i].filename);
+	}
+	free(entries);
+}
+
+static int sort_entries_by_filename(const void *a, const void *b) {
+	return strcmp(((const struct input_entry*)a)->filename, ((const struct input_entry*)b)->filename);
+}
+
 /*
  * Opens the directory given in parameter "dir" and reads the filenames
- * of all .jpg files, stores them in a list and initiates the creation
- * of the scaled images and html pages. Returns the number of images
- * found in this directory.
+ * of all image files and (with -R) subdirectories, and stores them in
+ * sorted, malloc()ed lists. Image files are recognized by their header
+ * (or with --no-sniff, by their extension), and they are kept open for
+ * create_thumbnail. Returns 0 if the directory can't be opened.
  */
-static void process_dir(char *dir) {
-	char **imglist;
+static char scan_dir(const char *dir, struct input_entry **imglist_out, unsigned *imgcount_out,
+                     char ***subdirlist_out, unsigned *subdircount_out) {
+	struct input_entry *imglist, *entry;
 	unsigned imgcount, imgcapacity;
 	char **subdirlist;
 	unsigned subdircount, subdircapacity;
-	unsigned i;
 	char *fn;
 	unsigned dir_size;
 	struct dirent *dent;
 	struct stat sb;
 	DIR *thisdir;
-	FILE *f;
 	char header[24];
-	unsigned header_size;
-	int stat_result;
+	ssize_t header_size;
+	imgfmt_t format;
+	int stat_result, fd;
 
 	if ((thisdir = opendir(dir)) == NULL) {
 		fprintf(stderr, "%s: can't opendir(%s): %s\n", g_flags.progname, dir,
 		    strerror(errno));
-		g_flags.exit_code |= 2;
-		return;
+		add_exit_code(2);
+		return 0;
 	}
 
 	dir_size = strlen(dir);
@@ -258,10 +769,10 @@ static void process_dir(char *dir) {
 		if (dent->d_name[0] == '.' &&  /* Skip "." and ".." */
 		    (dent->d_name[1] == '\0' || (dent->d_name[1] == '.' && dent->d_name[2] == '\0'))) continue;
 		d_name_size = strlen(dent->d_name);
-		if (d_name_size >= 7 && 0 == memcmp(dent->d_name + d_name_size - 7, ".th.jpg", 7 * sizeof(char))) continue;
+		if (is_thumbnail_filename(dent->d_name)) continue;
 		check_alloc(fn = malloc(dir_size + d_name_size + 2));
 		sprintf(fn, "%s/%s", dir, dent->d_name);
-		stat_result = 0;
+		stat_result = 1;  /* Not called. */
 		/* TODO(pts): Don't enter to symlinks to directories. */
 		if (
 #ifdef DT_UNKNOWN
@@ -275,11 +786,11 @@ static void process_dir(char *dir) {
 			free(fn);
 			continue;
 		}
-		if (stat_result != 0) {
+		if (stat_result < 0) {
 			fprintf(stderr, "%s: can't stat(%s): %s\n", g_flags.progname,
 			    fn, strerror(errno));
 			free(fn);
-			g_flags.exit_code |= 2;
+			add_exit_code(2);
 			continue;
 		}
 		if (/* is_dir = */
@@ -295,36 +806,71 @@ static void process_dir(char *dir) {
 			subdirlist[subdircount++] = fn;  /* Takes ownership. */
 			continue;
 		}
-		if ((f = fopen(fn, "rb")) != NULL) {
-			header_size = fread(header, sizeof(char), sizeof(header), f);
-			if (ferror(f) || header_size == 0 || detect_image_format(header, header_size) == IF_UNKNOWN) {
-				fclose(f);
+		fd = -1;
+		format = IF_UNKNOWN;
+		if (g_flags.no_sniff && has_image_extension(dent->d_name)) {
+			/* The format will be detected after mapping the file. */
+		} else if ((fd = open(fn, O_RDONLY)) >= 0) {
+			if ((stat_result != 0 && (stat_result = fstat(fd, &sb)) != 0) ||
+			    (header_size = pread(fd, header, sizeof(header), 0)) <= 0 ||
+			    (format = detect_image_format(header, header_size)) == IF_UNKNOWN) {
+				close(fd);
 				free(fn);
 				continue;  /* Silently skip non-JPEG files when scanning recursively (-R). */
 			}
-			fclose(f);
+			if (!reserve_scanned_fd()) {
+				close(fd);
+				fd = -1;
+			}
 		}
 		if (imgcount == imgcapacity) {
 			imgcapacity = imgcapacity < 16 ? 16 : imgcapacity << 1;
 			check_alloc(imglist = realloc(imglist, imgcapacity * sizeof(*imglist)));
 		}
-		imglist[imgcount++] = fn;  /* Takes ownership. */
+		entry = imglist + imgcount++;
+		entry->filename = fn;  /* Takes ownership. */
+		entry->has_stat = stat_result == 0;
+		if (entry->has_stat) entry->sb = sb;
+		entry->fd = fd;
+		entry->format = format;
 	}
 
 	if (closedir(thisdir)) {
 		fprintf(stderr, "%s: error on closedir(%s): %s", g_flags.progname, dir,
 		    strerror(errno));
-		g_flags.exit_code |= 2;
+		add_exit_code(2);
 	}
 	/* Sort imglist according to desired sorting function. */
-	qsort(imglist, imgcount, sizeof(*imglist), sort_by_filename);
-	for (i = 0; i < imgcount; ++i) {
-		create_thumbnail(imglist[i]);
-		free(imglist[i]);
+	qsort(imglist, imgcount, sizeof(*imglist), sort_entries_by_filename);
+	qsort(subdirlist, subdircount, sizeof(*subdirlist), sort_by_filename);
+	*imglist_out = imglist;
+	*imgcount_out = imgcount;
+	*subdirlist_out = subdirlist;
+	*subdircount_out = subdircount;
+	return 1;
+}
+
+static void process_dir_tree(char *dir);
+
+/*
+ * Creates the thumbnails of the images in directory dir, and (with -R)
+ * its subdirectories. With worker threads, it runs process_dir_tree.
+ */
+static void process_dir(char *dir) {
+	struct input_entry *imglist;
+	unsigned imgcount;
+	char **subdirlist;
+	unsigned subdircount;
+	unsigned i;
+
+	if (g_pool.nthreads > 0) {
+		process_dir_tree(dir);
+		return;
 	}
-	free(imglist);
+	if (!scan_dir(dir, &imglist, &imgcount, &subdirlist, &subdircount)) return;
+	process_files(imglist, imgcount);
+	free_input_entries(imglist, imgcount);
 	printf("%d image%s processed in dir: %s\n", imgcount, imgcount != 1 ? "s" : "", dir);
-	qsort(subdirlist, subdircount, sizeof(*subdirlist), sort_by_filename);
 	for (i = 0; i < subdircount; ++i) {
 		process_dir(subdirlist[i]);
 		free(subdirlist[i]);
@@ -332,6 +878,186 @@ static void process_dir(char *dir) {
 	free(subdirlist);
 }
 
+/* --- Input files */
+
+/* The contents of an input file, mmap()ed, or read to memory if that fails. */
+struct input_file {
+	const unsigned char *data;  /* NULL if size == 0. */
+	size_t size;
+	char is_mapped;
+};
+
+/*
+ * Maps (or reads) the file open as fd, whose fstat is sb, and closes fd.
+ * Returns 0 on error, with errno set.
+ */
+static char read_input_fd(struct input_file *in, int fd, const struct stat *sb) {
+	unsigned char *data = NULL;
+	size_t capacity;
+	ssize_t got;
+	void *p;
+	int saved_errno;
+
+	in->data = NULL;
+	in->size = 0;
+	in->is_mapped = 0;
+	if (S_ISREG(sb->st_mode) && sb->st_size > 0 && (size_t)sb->st_size == (unsigned long long)sb->st_size &&
+	    (p = mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		(void)madvise(p, sb->st_size, MADV_SEQUENTIAL);
+		in->data = p;
+		in->size = sb->st_size;
+		in->is_mapped = 1;
+		close(fd);
+		return 1;
+	}
+	/* Not a regular file, or mmap failed: read it. */
+	capacity = S_ISREG(sb->st_mode) && sb->st_size > 0 ? sb->st_size + 1 : 8192;
+	check_alloc(data = malloc(capacity));
+	for (;;) {
+		if (in->size == capacity) check_alloc(data = realloc(data, capacity <<= 1));
+		if ((got = read(fd, data + in->size, capacity - in->size)) < 0) {
+			if (errno == EINTR) continue;
+			free(data);
+			goto do_error;
+		}
+		if (got == 0) break;
+		in->size += got;
+	}
+	if (in->size == 0) {
+		free(data);
+	} else {
+		in->data = data;
+	}
+	close(fd);
+	return 1;
+ do_error:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	in->size = 0;
+	return 0;
+}
+
+/* Returns 0 on error, with errno set. Sets entry->sb if not set yet. */
+static char open_input_entry(struct input_file *in, struct input_entry *entry) {
+	int fd, saved_errno;
+
+	in->data = NULL;
+	in->size = 0;
+	in->is_mapped = 0;
+	if ((fd = take_entry_fd(entry)) < 0) {  /* Not kept open by scan_dir. */
+		if ((fd = open(entry->filename, O_RDONLY)) < 0) return 0;
+		if (!entry->has_stat) {
+			if (fstat(fd, &entry->sb) != 0) {
+				saved_errno = errno;
+				close(fd);
+				errno = saved_errno;
+				return 0;
+			}
+			entry->has_stat = 1;
+		}
+	}
+	return read_input_fd(in, fd, &entry->sb);
+}
+
+static void close_input_file(struct input_file *in) {
+	if (in->is_mapped) {
+		munmap((void*)in->data, in->size);
+	} else {
+		free((void*)in->data);
+	}
+	in->data = NULL;
+	in->size = 0;
+}
+
+#if JPEG_LIB_VERSION < 80 && !defined(MEM_SRCDST_SUPPORTED)
+#include <jerror.h>
+
+/* Replacements of jpeg_mem_src and jpeg_mem_dest for libjpeg versions which don't have them. */
+
+static void mem_src_noop(j_decompress_ptr cinfo) {
+	(void)cinfo;
+}
+
+static boolean mem_src_fill_input_buffer(j_decompress_ptr cinfo) {
+	/* Premature end of file: insert a fake EOI marker, as jpeg_stdio_src does. */
+	static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+static void mem_src_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+	if (num_bytes <= 0) return;
+	if ((unsigned long)num_bytes > cinfo->src->bytes_in_buffer) {
+		(void)mem_src_fill_input_buffer(cinfo);
+	} else {
+		cinfo->src->next_input_byte += num_bytes;
+		cinfo->src->bytes_in_buffer -= num_bytes;
+	}
+}
+
+static void jpeg_mem_src(j_decompress_ptr cinfo, unsigned char *data, unsigned long size) {
+	struct jpeg_source_mgr *src = cinfo->src;
+	if (src == NULL) {
+		cinfo->src = src = (struct jpeg_source_mgr*)(*cinfo->mem->alloc_small)
+		    ((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(struct jpeg_source_mgr));
+	}
+	src->init_source = mem_src_noop;
+	src->fill_input_buffer = mem_src_fill_input_buffer;
+	src->skip_input_data = mem_src_skip_input_data;
+	src->resync_to_restart = jpeg_resync_to_restart;
+	src->term_source = mem_src_noop;
+	src->next_input_byte = data;
+	src->bytes_in_buffer = size;
+}
+
+struct mem_destination_mgr {
+	struct jpeg_destination_mgr pub;
+	unsigned char **outbuffer;
+	unsigned long *outsize;
+	unsigned char *buffer;
+	size_t capacity;
+};
+
+static void mem_dest_init_destination(j_compress_ptr cinfo) {
+	struct mem_destination_mgr *dest = (struct mem_destination_mgr*)cinfo->dest;
+	check_alloc(dest->buffer = malloc(dest->capacity = 4096));
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = dest->capacity;
+}
+
+static boolean mem_dest_empty_output_buffer(j_compress_ptr cinfo) {
+	struct mem_destination_mgr *dest = (struct mem_destination_mgr*)cinfo->dest;
+	check_alloc(dest->buffer = realloc(dest->buffer, dest->capacity << 1));
+	dest->pub.next_output_byte = dest->buffer + dest->capacity;
+	dest->pub.free_in_buffer = dest->capacity;
+	dest->capacity <<= 1;
+	return TRUE;
+}
+
+static void mem_dest_term_destination(j_compress_ptr cinfo) {
+	struct mem_destination_mgr *dest = (struct mem_destination_mgr*)cinfo->dest;
+	*dest->outbuffer = dest->buffer;
+	*dest->outsize = dest->capacity - dest->pub.free_in_buffer;
+}
+
+/* Always allocates a new buffer, which the caller has to free(). */
+static void jpeg_mem_dest(j_compress_ptr cinfo, unsigned char **outbuffer, unsigned long *outsize) {
+	struct mem_destination_mgr *dest = (struct mem_destination_mgr*)cinfo->dest;
+	if (dest == NULL) {
+		cinfo->dest = (struct jpeg_destination_mgr*)(dest = (struct mem_destination_mgr*)(*cinfo->mem->alloc_small)
+		    ((j_common_ptr)cinfo, JPOOL_PERMANENT, sizeof(struct mem_destination_mgr)));
+	}
+	dest->pub.init_destination = mem_dest_init_destination;
+	dest->pub.empty_output_buffer = mem_dest_empty_output_buffer;
+	dest->pub.term_destination = mem_dest_term_destination;
+	dest->outbuffer = outbuffer;
+	dest->outsize = outsize;
+}
+#endif
+
 struct my_jpeg_error_mgr {
 	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
@@ -348,45 +1074,283 @@ static void my_jpeg_error_exit(j_common_ptr cinfo) {
 	longjmp(myerr->setjmp_buffer, 1); /* Jump to the setjmp point */
 }
 
-struct image {
-  unsigned num_components;
-  unsigned width;
-  unsigned height;
-  unsigned output_width;
-  unsigned output_height;
-  J_COLOR_SPACE colorspace;
+/* A decoder whose scanlines are read on demand, for streaming (-S). */
+struct image_stream {
+	/*
+	 * Reads at most n (at least 1) scanlines to rows. Returns the number
+	 * of scanlines read, or 0 on a fatal error, already printed.
+	 */
+	unsigned (*read_rows)(struct image_stream *s, JSAMPARRAY rows, unsigned n);
+	/* Reads the remaining scanlines unless has_error, and frees the decoder. May set has_error. */
+	void (*finish)(struct image_stream *s);
+	/* Frees the decoder without reading the rest. */
+	void (*destroy)(struct image_stream *s);
+	struct input_file input;  /* Owned. */
+	JSAMPARRAY rows;  /* The last nrows scanlines read, indexed by y % nrows. */
+	unsigned nrows;
+	unsigned max_read_rows;  /* read_rows doesn't read more than this at once. */
+	unsigned row_width;
+	unsigned height;
+	unsigned rows_read;
+	char has_error;
+	j_compress_ptr cinfo;  /* Output rows are written here. */
+	JSAMPARRAY out_rows;  /* Resized rows not written yet, indexed by y % out_nrows. */
+	unsigned out_nrows;
+};
 
-  unsigned scalewidth;
-  unsigned scaleheight;
-  unsigned char *data;
-  FILE *outfile;
+/* Takes ownership of in. The decoder has to set the rest. */
+static void init_image_stream(struct image_stream *s, const struct input_file *in, unsigned row_width, unsigned height) {
+	s->input = *in;
+	s->row_width = row_width;
+	s->height = height;
+	s->rows_read = 0;
+	s->has_error = 0;
+	s->cinfo = NULL;
+	s->out_rows = NULL;
+	s->out_nrows = 0;
+}
+
+/* A JPEG decoder streaming its scanlines. */
+struct jpeg_stream {
+	struct image_stream s;  /* Must be the first. */
+	struct jpeg_decompress_struct dinfo;
+	struct my_jpeg_error_mgr derrmgr;
 };
 
-/* Returns whether the scaled image file should be produced. */
-static char compute_scaledims(struct image *img, char is_input_jpeg) {
-	/* ratio needed to scale image correctly. */
-	double ratio = (double)img->width / (double)img->height;
-	img->scaleheight = g_flags.scaleheight;
-	img->scalewidth = (int)((double)img->scaleheight * ratio + 0.5);
-	/* TODO(pts): Fix too large width. */
-	/* Is the image smaller than the thumbnail? */
-	if (img->scaleheight >= img->height && img->scalewidth >= img->width) {
-		if (!is_input_jpeg || g_flags.also_small) {
-			/* Re-encode to JPEG in original size. */
-			img->scaleheight = img->height;
-			img->scalewidth = img->width;
-		} else {
-			/* Skip creating the thumbnail. */
-			return 0;
-		}
-	}
-	return 1;
+/* --- Statistics (--stats) */
+
+enum stats_stage { ST_OPEN, ST_DECODE, ST_RESIZE, ST_ENCODE, ST_WRITE, ST_COUNT };
+static const char *const stats_stage_names[ST_COUNT] = {
+	"open", "decode", "resize", "encode", "write",
+};
+
+/* Timings of one image, in seconds. */
+struct image_stats {
+	imgfmt_t format;
+	unsigned scale_eighths;  /* JPEG decoding scale is scale_eighths/8, 0 for other formats. */
+	unsigned long long input_size;
+	char *filename;  /* Owned, only with --draft. */
+	double default_decode_wall;  /* With --draft: JPEG decode time with the default profile. */
+	double wall[ST_COUNT], cpu[ST_COUNT];
+	double wall_start, cpu_start;  /* Of the current stage. */
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct image_stats *items;
+	unsigned count, capacity;
+	double start_wall;
+} g_stats = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0.0 };
+
+static double clock_seconds(clockid_t clock_id) {
+	struct timespec ts;
+	if (clock_gettime(clock_id, &ts) != 0) return 0.0;
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-/* Called by load_image.
+/* Starts timing a stage in the current thread. */
+static void stats_start(struct image_stats *st) {
+	if (!g_flags.stats) return;
+	st->wall_start = clock_seconds(CLOCK_MONOTONIC);
+	st->cpu_start = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* Adds the time since stats_start to stage, and starts timing the next one. */
+static void stats_stop(struct image_stats *st, enum stats_stage stage) {
+	double wall, cpu;
+	if (!g_flags.stats) return;
+	wall = clock_seconds(CLOCK_MONOTONIC);
+	cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+	st->wall[stage] += wall - st->wall_start;
+	st->cpu[stage] += cpu - st->cpu_start;
+	st->wall_start = wall;
+	st->cpu_start = cpu;
+}
+
+/* Records the timings of a thumbnail created successfully. */
+static void stats_add(const struct image_stats *st) {
+	if (!g_flags.stats) return;
+	pthread_mutex_lock(&g_stats.mutex);
+	if (g_stats.count == g_stats.capacity) {
+		g_stats.capacity = g_stats.capacity ? 2 * g_stats.capacity : 64;
+		check_alloc(g_stats.items = realloc(g_stats.items, g_stats.capacity * sizeof(*g_stats.items)));
+	}
+	g_stats.items[g_stats.count++] = *st;
+	pthread_mutex_unlock(&g_stats.mutex);
+}
+
+static int compare_stats_filenames(const void *a, const void *b) {
+	return strcmp(((const struct image_stats*)a)->filename, ((const struct image_stats*)b)->filename);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	const double da = *(const double*)a, db = *(const double*)b;
+	return da < db ? -1 : da > db;
+}
+
+/* Returns the p-th percentile (nearest rank) of the sorted values[0..n-1]. */
+static double percentile(const double *values, unsigned n, unsigned p) {
+	unsigned rank = (n * p + 99) / 100;
+	return n == 0 ? 0.0 : values[rank > 0 ? rank - 1 : 0];
+}
+
+/* Prints a line about the images matching format and scale_eighths (0: any). */
+static void print_stats_group(const char *name, imgfmt_t format, unsigned scale_eighths, double *latencies) {
+	unsigned i, n = 0, s;
+	double wall = 0.0, cpu = 0.0, mb = 0.0;
+	for (i = 0; i < g_stats.count; ++i) {
+		const struct image_stats *st = g_stats.items + i;
+		if (format != IF_UNKNOWN && st->format != format) continue;
+		if (scale_eighths != 0 && st->scale_eighths != scale_eighths) continue;
+		latencies[n] = 0.0;
+		for (s = 0; s < ST_COUNT; ++s) {
+			latencies[n] += st->wall[s];
+			cpu += st->cpu[s];
+		}
+		wall += latencies[n++];
+		mb += st->input_size / 1e6;
+	}
+	if (n == 0) return;
+	qsort(latencies, n, sizeof(double), compare_doubles);
+	printf("%-8s %6u %9.2f %8.3f %8.3f %8.2f %8.2f %8.2f %8.1f %8.2f\n",
+	       name, n, mb, wall, cpu,
+	       percentile(latencies, n, 50) * 1e3, percentile(latencies, n, 95) * 1e3,
+	       percentile(latencies, n, 99) * 1e3,
+	       wall > 0 ? n / wall : 0.0, wall > 0 ? mb / wall : 0.0);
+}
+
+static void stats_init(void) {
+	g_stats.start_wall = clock_seconds(CLOCK_MONOTONIC);
+}
+
+/* Prints the report of --stats to stdout. */
+static void print_stats(void) {
+	static const struct { const char *name; imgfmt_t format; unsigned scale_eighths; } groups[] = {
+		{ "all", IF_UNKNOWN, 0 }, { "JPEG", IF_JPEG, 0 }, { "JPEG 8/8", IF_JPEG, 8 },
+		{ "JPEG 7/8", IF_JPEG, 7 }, { "JPEG 6/8", IF_JPEG, 6 }, { "JPEG 5/8", IF_JPEG, 5 },
+		{ "JPEG 4/8", IF_JPEG, 4 }, { "JPEG 3/8", IF_JPEG, 3 }, { "JPEG 2/8", IF_JPEG, 2 },
+		{ "JPEG 1/8", IF_JPEG, 1 }, { "PNG", IF_PNG, 0 }, { "GIF", IF_GIF, 0 },
+	};
+	double elapsed = clock_seconds(CLOCK_MONOTONIC) - g_stats.start_wall, mb = 0.0, wall, cpu;
+	double *values;
+	unsigned i, s;
+
+	check_alloc(values = malloc((g_stats.count + 1) * sizeof(double)));
+	for (i = 0; i < g_stats.count; ++i) mb += g_stats.items[i].input_size / 1e6;
+	printf("stats: %u thumbnail%s in %.3f s, %.1f images/s, %.2f MB/s input, %d job%s%s\n",
+	       g_stats.count, g_stats.count != 1 ? "s" : "", elapsed,
+	       elapsed > 0 ? g_stats.count / elapsed : 0.0, elapsed > 0 ? mb / elapsed : 0.0,
+	       g_flags.jobs, g_flags.jobs != 1 ? "s" : "",
+	       g_flags.stream && !g_flags.pipeline ? ", -S: JPEG and PNG decode and resize are in encode" : "");
+	printf("stage       wall_s    cpu_s   p50_ms   p95_ms   p99_ms\n");
+	for (s = 0; s < ST_COUNT; ++s) {
+		wall = cpu = 0.0;
+		for (i = 0; i < g_stats.count; ++i) {
+			values[i] = g_stats.items[i].wall[s];
+			wall += g_stats.items[i].wall[s];
+			cpu += g_stats.items[i].cpu[s];
+		}
+		qsort(values, g_stats.count, sizeof(double), compare_doubles);
+		printf("%-8s %9.3f %8.3f %8.2f %8.2f %8.2f\n", stats_stage_names[s], wall, cpu,
+		       percentile(values, g_stats.count, 50) * 1e3, percentile(values, g_stats.count, 95) * 1e3,
+		       percentile(values, g_stats.count, 99) * 1e3);
+	}
+	/* img/s and MB/s are per thread: divided by the sum of latencies. */
+	printf("format    count     MB_in   wall_s    cpu_s   p50_ms   p95_ms   p99_ms    img/s     MB/s\n");
+	for (i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i)
+		print_stats_group(groups[i].name, groups[i].format, groups[i].scale_eighths, values);
+	free(values);
+	if (g_flags.draft) {
+		qsort(g_stats.items, g_stats.count, sizeof(*g_stats.items), compare_stats_filenames);
+		printf("draft_decode_ms default_decode_ms  image\n");
+		for (i = 0; i < g_stats.count; ++i) {
+			if (g_stats.items[i].format != IF_JPEG) continue;
+			printf("%15.2f %17.2f  %s\n", g_stats.items[i].wall[ST_DECODE] * 1e3,
+			       g_stats.items[i].default_decode_wall * 1e3, g_stats.items[i].filename);
+		}
+		for (i = 0; i < g_stats.count; ++i) free(g_stats.items[i].filename);
+	}
+}
+
+/* A plane of samples of a YCbCr image, decoded or compressed as raw data. */
+struct plane {
+  unsigned width, height;  /* Samples in the image. */
+  unsigned stride, nrows;  /* Allocated, including the padding to full iMCU rows. */
+  unsigned scale_num, scale_den;  /* Size relative to the image, e.g. 1/2 for 4:2:0 chroma. */
+  unsigned char *data;
+};
+
+struct image {
+  unsigned num_components;
+  unsigned width;
+  unsigned height;
+  unsigned output_width;
+  unsigned output_height;
+  J_COLOR_SPACE colorspace;
+
+  unsigned scalewidth;
+  unsigned scaleheight;
+  /* Thumbnail heights to choose scaleheight from, largest first. Advanced by compute_scaledims. */
+  const int *heights;
+  unsigned nheights;
+  unsigned char *data;
+  /* If true, data contains the planes (with colorspace JCS_YCbCr) rather than pixels. */
+  char is_raw;
+  struct plane planes[3];
+  FILE *outfile;
+  /* If not NULL, data is NULL, and the scanlines will be read from here. */
+  struct image_stream *stream;
+  struct image_stats stats;
+};
+
+/*
+ * Sets the thumbnail size from the first of img->heights which should be
+ * produced, and drops the heights before it.
+ * Returns whether any scaled image file should be produced.
+ */
+static char compute_scaledims(struct image *img, char is_input_jpeg) {
+	/* ratio needed to scale image correctly. */
+	double ratio = (double)img->width / (double)img->height;
+	for (; img->nheights > 0; ++img->heights, --img->nheights) {
+		img->scaleheight = img->heights[0];
+		img->scalewidth = (int)((double)img->scaleheight * ratio + 0.5);
+		if (img->scalewidth == 0) img->scalewidth = 1;  /* libjpeg can't compress an empty image. */
+		/* TODO(pts): Fix too large width. */
+		/* Is the image smaller than the thumbnail? */
+		if (img->scaleheight < img->height || img->scalewidth < img->width) return 1;
+		if (!is_input_jpeg || g_flags.also_small) {
+			/* Re-encode to JPEG in original size. */
+			img->scaleheight = img->height;
+			img->scalewidth = img->width;
+			return 1;
+		}
+		/* Skip creating this thumbnail, try the next (smaller) height. */
+	}
+	return 0;
+}
+
+/*
+ * With --detect-gray, converts the decoded RGB pixels of img to gray in
+ * place if all of them are gray.
+ */
+static void detect_gray_image(struct image *img) {
+	const size_t n = (size_t)img->output_width * img->output_height;
+	const unsigned char *p, *p_end;
+	unsigned char *q;
+	if (!g_flags.detect_gray || img->num_components != 3 || !img->data) return;
+	for (p = img->data, p_end = p + 3 * n; p != p_end; p += 3) {
+		if (p[0] != p[1] || p[0] != p[2]) return;
+	}
+	for (p = q = img->data; p != p_end; p += 3) *q++ = *p;
+	check_alloc(img->data = realloc(img->data, n ? n : 1));
+	img->num_components = 1;
+	img->colorspace = JCS_GRAYSCALE;
+}
+
+/* Called by load_image.
  * Returns whether the scaled image file should be produced.
  */
-static char load_image_gif(struct image *img, const char *filename, FILE *infile, const char *tmp_filename) {
+static char load_image_gif(struct image *img, const char *filename, const struct input_file *in) {
 	char const *err;
 	GifFileType *giff;
 	SavedImage *sp;
@@ -396,15 +1360,15 @@ static char load_image_gif(struct image *img, const char *filename, FILE *infile
 	unsigned char *pr;
 	const unsigned char *pi, *pi_end;
 
-	if (0==(giff=DGifOpenFILE(infile)) || GIF_ERROR==DGifSlurp(giff, 1 /* do_decode_first_image_only */)) {
+	if (0==(giff=DGifOpenMem(in->data, in->size)) || GIF_ERROR==DGifSlurp(giff, 1 /* do_decode_first_image_only */)) {
 		fprintf(stderr, "%s: error reading GIF file: %s: %s\n", g_flags.progname, filename, ((err=GetGifError()) ? err : "unknown error"));
-		g_flags.exit_code |= 4;
+		add_exit_code(4);
 		if (giff) DGifCloseFile(giff);
 		return 0;
 	}
 	if (giff->ImageCount<1) {
 		fprintf(stderr, "%s: no image in GIF file: %s\n", g_flags.progname, filename);
-		g_flags.exit_code |= 4;
+		add_exit_code(4);
 		DGifCloseFile(giff);
 		return 0;
 	}
@@ -420,28 +1384,31 @@ static char load_image_gif(struct image *img, const char *filename, FILE *infile
 		return 0;
 	}
 
-	if ((img->outfile = fopen(tmp_filename, "wb")) == NULL) {
-		DGifCloseFile(giff);
-		fprintf(stderr, "%s: can't fopen(%s): %s\n", g_flags.progname, tmp_filename, strerror(errno));
-		g_flags.exit_code |= 2;
-		return 0;
-	}
-
 	cm = sp->ImageDesc.ColorMap ? sp->ImageDesc.ColorMap : giff->SColorMap;
 	co = cm->Colors;
+	for (c = 0; c < (unsigned)cm->ColorCount && co[c].Red == co[c].Green && co[c].Red == co[c].Blue; ++c) {}
+	if (c == (unsigned)cm->ColorCount) {  /* Only grays in the palette. */
+		img->num_components = 1;
+		img->colorspace = JCS_GRAYSCALE;
+	}
 	c = img->num_components * img->width * img->height;
 	check_alloc(img->data = pr = malloc(c * sizeof(unsigned char)));
 	pi = (const unsigned char*)sp->RasterBits;
 	pi_end = pi + img->width * img->height;
-	while (pi != pi_end) {
-		GifColorType *coi = co + *pi++;
-		/* We could check if the color value is smaller than cm->ColorCount. */
-		*pr++ = coi->Red;
-		*pr++ = coi->Green;
-		*pr++ = coi->Blue;
+	if (img->num_components == 1) {
+		while (pi != pi_end) *pr++ = co[*pi++].Red;
+	} else {
+		while (pi != pi_end) {
+			GifColorType *coi = co + *pi++;
+			/* We could check if the color value is smaller than cm->ColorCount. */
+			*pr++ = coi->Red;
+			*pr++ = coi->Green;
+			*pr++ = coi->Blue;
+		}
 	}
 	/* sp->transp is the transparency color index: -1 or 0..255. We ignore it now. */
 	DGifCloseFile(giff);  /* Also frees memory. */
+	detect_gray_image(img);
 	return 1;
 }
 
@@ -498,7 +1465,7 @@ struct swigpng_jmpbuf_wrapper {
   const char *filename;
 };
 
-/* TODO(pts): Speed this up for non-16-bit PNGs. */
+/* Used by the generic row converter only, the others read bytes directly. */
 static png_uint_16 swigpng_get_png_val(png_byte **pp, int bit_depth) {
   const png_uint_16 c = (bit_depth == 16) ? (*((*pp)++)) << 8 : 0;
   return c | (*((*pp)++));
@@ -511,6 +1478,294 @@ static png_uint_16 swigpng_gamma_correct(png_uint_16 v, float gamma, float maxva
     return v;
 }
 
+/*
+ * Converts rows of PNG samples (as read by libpng) to 8-bit RGB, mixing
+ * them with the background by alpha. The row function is selected by
+ * init_png_converter once per image, based on the color type, the bit
+ * depth and tRNS.
+ */
+struct png_converter {
+  void (*convert_row)(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width);
+  int bit_depth;
+  png_byte color_type;
+  png_uint_16 maxval;
+  png_uint_16 bgr, bgg, bgb;  /* Background colors. */
+  char has_trans;  /* Is trans_* valid? */
+  png_uint_16 trans_r, trans_g, trans_b, trans_gray;
+  int num_palette;
+  png_colorp palette;
+  int num_trans;  /* Number of palette entries in trans_alpha, or -1. */
+  png_bytep trans_alpha;
+  unsigned char scale[256];  /* Sample value (if maxval < 256) to 0..255. */
+  unsigned char trans_rgb[3];  /* Output of the transparent color. */
+  unsigned char lut[256][3];  /* Output of each gray value, or palette index pre-mixed by tRNS. */
+  unsigned char ncomps;  /* Output components per pixel: 1 (gray) or 3 (RGB). */
+};
+
+/* Mixes v with the background bg by alpha a (of 0..255), rounding to nearest. */
+static unsigned char png_mix255(unsigned v, unsigned a, unsigned bg) {
+  return (v * a + bg * (255 - a) + 127) / 255;
+}
+
+/*
+ * Mixes a pixel with the background by its alpha, and scales it from
+ * maxval to 255. This is the reference all row converters must match.
+ */
+static void png_mix_scale(const struct png_converter *cv, png_uint_16 r, png_uint_16 g, png_uint_16 b, png_uint_16 a, unsigned char *out) {
+  const png_uint_16 maxval = cv->maxval;
+  if (a != maxval) {  /* Doesn't overflow, all values are at most 65535. */
+    /* TODO(pts): Convert to maxval=255 first, and only then mix, for better rounding. */
+    r = ((png_uint_32)r * a + (png_uint_32)cv->bgr * (maxval - a) + maxval / 2) / maxval;
+    g = ((png_uint_32)g * a + (png_uint_32)cv->bgg * (maxval - a) + maxval / 2) / maxval;
+    b = ((png_uint_32)b * a + (png_uint_32)cv->bgb * (maxval - a) + maxval / 2) / maxval;
+  }
+  if (maxval == 255) {
+  } else if (maxval <= 1) {
+    r *= 255;
+    g *= 255;
+    b *= 255;
+  } else if (maxval == 15) {
+    r *= 17;
+    g *= 17;
+    b *= 17;
+  } else if (maxval == 3) {
+    r *= 85;
+    g *= 85;
+    b *= 85;
+  } else if (maxval == 65535) {  /* 16-bit PNG. */
+    r >>= 8;
+    g >>= 8;
+    b >>= 8;
+  } else {  /* TODO(pts): Can this happen? */
+    r = (png_uint_32)r * 255 / maxval;
+    g = (png_uint_32)g * 255 / maxval;
+    b = (png_uint_32)b * 255 / maxval;
+  }
+  out[0] = r;
+  out[1] = g;
+  out[2] = b;
+}
+
+/* Any color type and bit depth, e.g. 16-bit. */
+static void png_convert_row_generic(const struct png_converter *cv, png_byte *png_pixel, unsigned char *out, png_uint_32 width) {
+  const png_uint_16 maxval = cv->maxval;
+  png_uint_16 r, g, b, a, pi;
+  unsigned char rgb[3];
+  for (; width > 0; --width, out += cv->ncomps) {
+    r = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+    switch (cv->color_type) {
+      case PNG_COLOR_TYPE_GRAY:
+        g = b = r;
+        a = cv->has_trans && r == cv->trans_gray ? 0 : maxval;
+        break;
+
+      case PNG_COLOR_TYPE_GRAY_ALPHA:
+        g = b = r;
+        a = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        break;
+
+      case PNG_COLOR_TYPE_PALETTE:
+        pi = r;
+        r = cv->palette[pi].red;
+        g = cv->palette[pi].green;
+        b = cv->palette[pi].blue;
+        a = (int)pi < cv->num_trans ? (png_uint_32)cv->trans_alpha[pi] * maxval / 255 : maxval;
+        break;
+
+      case PNG_COLOR_TYPE_RGB:
+        g = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        b = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        a = (cv->has_trans && r == cv->trans_r && g == cv->trans_g && b == cv->trans_b) ? 0 : maxval;
+        break;
+
+      case PNG_COLOR_TYPE_RGB_ALPHA:
+      default:  /* Nothing else supported. */
+        g = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        b = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        a = swigpng_get_png_val(&png_pixel, cv->bit_depth);
+        break;
+    }
+    if (cv->ncomps == 1) {
+      png_mix_scale(cv, r, g, b, a, rgb);
+      *out = rgb[0];
+    } else {
+      png_mix_scale(cv, r, g, b, a, out);
+    }
+  }
+}
+
+/* Palette with colors: one byte per pixel, looked up in cv->lut. */
+static void png_convert_row_lut(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  const unsigned char *c;
+  png_uint_32 x;
+  for (x = 0; x < width; ++x) {
+    c = cv->lut[in[x]];
+    out[3 * x] = c[0];
+    out[3 * x + 1] = c[1];
+    out[3 * x + 2] = c[2];
+  }
+}
+
+/* Gray of at most 8 bits, and palette of only grays: looked up in cv->lut, one byte per pixel. */
+static void png_convert_row_lut1(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  png_uint_32 x;
+  for (x = 0; x < width; ++x) {
+    out[x] = cv->lut[in[x]][0];
+  }
+}
+
+/* 8-bit RGB without tRNS and sBIT. */
+static void png_convert_row_rgb8_copy(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  (void)cv;
+  memcpy(out, in, 3 * width);
+}
+
+/* 8-bit RGB, with tRNS or sBIT. */
+static void png_convert_row_rgb8(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  png_uint_32 x;
+  for (x = 0; x < width; ++x, in += 3, out += 3) {
+    if (cv->has_trans && in[0] == cv->trans_r && in[1] == cv->trans_g && in[2] == cv->trans_b) {
+      memcpy(out, cv->trans_rgb, 3);
+    } else {
+      out[0] = cv->scale[in[0]];
+      out[1] = cv->scale[in[1]];
+      out[2] = cv->scale[in[2]];
+    }
+  }
+}
+
+/* Returns whether all pixels of an 8-bit row with alpha are opaque. */
+static char is_png_row_opaque(const png_byte *in, png_uint_32 width, unsigned ncomps, png_uint_16 maxval) {
+  png_byte all = 255;
+  png_uint_32 x;
+  if (maxval != 255) return 0;
+  for (x = ncomps - 1; x < width * ncomps; x += ncomps) all &= in[x];
+  return all == 255;
+}
+
+/* 8-bit RGBA. */
+static void png_convert_row_rgba8(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  const unsigned bgr = cv->bgr, bgg = cv->bgg, bgb = cv->bgb;
+  png_uint_32 x;
+  if (is_png_row_opaque(in, width, 4, cv->maxval)) {
+    for (x = 0; x < width; ++x) {
+      out[3 * x] = in[4 * x];
+      out[3 * x + 1] = in[4 * x + 1];
+      out[3 * x + 2] = in[4 * x + 2];
+    }
+    return;
+  }
+  if (cv->maxval == 255) {  /* Mixing with a == 255 is a no-op. */
+    for (x = 0; x < width; ++x) {
+      out[3 * x] = png_mix255(in[4 * x], in[4 * x + 3], bgr);
+      out[3 * x + 1] = png_mix255(in[4 * x + 1], in[4 * x + 3], bgg);
+      out[3 * x + 2] = png_mix255(in[4 * x + 2], in[4 * x + 3], bgb);
+    }
+    return;
+  }
+  for (x = 0; x < width; ++x, in += 4, out += 3) {
+    if (in[3] == cv->maxval) {
+      out[0] = cv->scale[in[0]];
+      out[1] = cv->scale[in[1]];
+      out[2] = cv->scale[in[2]];
+    } else {
+      png_mix_scale(cv, in[0], in[1], in[2], in[3], out);
+    }
+  }
+}
+
+/* 8-bit gray with alpha, to gray. The background of gray images is gray. */
+static void png_convert_row_ga8(const struct png_converter *cv, png_byte *in, unsigned char *out, png_uint_32 width) {
+  const unsigned bg = cv->bgr;
+  unsigned char rgb[3];
+  png_uint_32 x;
+  if (is_png_row_opaque(in, width, 2, cv->maxval)) {
+    for (x = 0; x < width; ++x) {
+      out[x] = in[2 * x];
+    }
+    return;
+  }
+  if (cv->maxval == 255) {  /* Mixing with a == 255 is a no-op. */
+    for (x = 0; x < width; ++x) {
+      out[x] = png_mix255(in[2 * x], in[2 * x + 1], bg);
+    }
+    return;
+  }
+  for (x = 0; x < width; ++x, in += 2) {
+    if (in[1] == cv->maxval) {
+      out[x] = cv->scale[in[0]];
+    } else {
+      png_mix_scale(cv, in[0], in[0], in[0], in[1], rgb);
+      out[x] = rgb[0];
+    }
+  }
+}
+
+/*
+ * Selects cv->convert_row for the other fields of cv, which must already
+ * be set, and precomputes its tables.
+ */
+static void init_png_converter(struct png_converter *cv) {
+  unsigned v;
+  png_uint_16 a;
+  if (cv->maxval < 256) {
+    for (v = 0; v < 256; ++v) {
+      png_mix_scale(cv, v, v, v, cv->maxval, cv->lut[v]);
+      cv->scale[v] = cv->lut[v][0];
+    }
+  }
+  if (cv->color_type == PNG_COLOR_TYPE_PALETTE) {
+    for (v = 0; v < 256; ++v) {
+      if ((int)v < cv->num_palette) {
+        /* trans_alpha is 0..255 even if sBIT has shifted the palette. */
+        a = (int)v < cv->num_trans ? (png_uint_32)cv->trans_alpha[v] * cv->maxval / 255 : cv->maxval;
+        png_mix_scale(cv, cv->palette[v].red, cv->palette[v].green, cv->palette[v].blue, a, cv->lut[v]);
+      } else {  /* Invalid index. */
+        memset(cv->lut[v], 0, 3);
+      }
+    }
+    cv->ncomps = 1;  /* Stay gray if the palette (mixed with the background) has only grays. */
+    for (v = 0; v < 256 && cv->ncomps == 1; ++v) {
+      if (cv->lut[v][0] != cv->lut[v][1] || cv->lut[v][0] != cv->lut[v][2]) cv->ncomps = 3;
+    }
+    cv->convert_row = cv->ncomps == 1 ? png_convert_row_lut1 : png_convert_row_lut;
+    return;
+  }
+  cv->ncomps = cv->color_type & PNG_COLOR_MASK_COLOR ? 3 : 1;
+  if (cv->color_type == PNG_COLOR_TYPE_GRAY && cv->bit_depth <= 8) {
+    if (cv->has_trans && cv->trans_gray < 256) {
+      png_mix_scale(cv, cv->trans_gray, cv->trans_gray, cv->trans_gray, 0, cv->lut[cv->trans_gray]);
+    }
+    cv->convert_row = png_convert_row_lut1;
+  } else if (cv->bit_depth == 8 && cv->color_type == PNG_COLOR_TYPE_RGB) {
+    if (cv->maxval == 255 && !cv->has_trans) {
+      cv->convert_row = png_convert_row_rgb8_copy;
+    } else {
+      png_mix_scale(cv, cv->trans_r, cv->trans_g, cv->trans_b, 0, cv->trans_rgb);
+      cv->convert_row = png_convert_row_rgb8;
+    }
+  } else if (cv->bit_depth == 8 && cv->color_type == PNG_COLOR_TYPE_RGB_ALPHA) {
+    cv->convert_row = png_convert_row_rgba8;
+  } else if (cv->bit_depth == 8 && cv->color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+    cv->convert_row = png_convert_row_ga8;
+  } else {
+    cv->convert_row = png_convert_row_generic;
+  }
+}
+
+/* The unread part of a PNG file in memory. */
+struct png_input {
+  const unsigned char *p, *end;
+};
+
+/* libpng read callback, reads from a struct png_input. */
+static void png_read_input(png_structp png_ptr, png_bytep data, png_size_t length) {
+  struct png_input *png_in = png_get_io_ptr(png_ptr);
+  if ((size_t)(png_in->end - png_in->p) < length) png_error(png_ptr, "Read Error");
+  memcpy(data, png_in->p, length);
+  png_in->p += length;
+}
+
 static void swigpng_error_handler(png_structp png_ptr, png_const_charp msg) {
   struct swigpng_jmpbuf_wrapper *jmpbuf_ptr = png_get_error_ptr(png_ptr);
   if (jmpbuf_ptr == NULL) abort();  /* we are completely hosed now */
@@ -528,17 +1783,155 @@ static void swigpng_error_handler(png_structp png_ptr, png_const_charp msg) {
   longjmp(jmpbuf_ptr->jmpbuf, 1);
 }
 
-static char load_image_png(struct image *img, const char *filename, FILE *infile, const char *tmp_filename) {
+/*
+ * If libpng itself can convert the image to 8-bit RGB (or gray, as
+ * cv->ncomps) identically to cv, sets up its transforms, and sets
+ * cv->convert_row to NULL. That is the case without alpha, tRNS and sBIT
+ * shifting, except for palettes of only grays. Alpha is mixed by cv, to
+ * avoid libpng's gamma processing in png_set_background.
+ */
+static void set_png_rgb_transforms(png_struct *png_ptr, struct png_converter *cv) {
+  if ((cv->color_type & PNG_COLOR_MASK_ALPHA) || cv->has_trans || cv->num_trans != 0 ||
+      cv->maxval != (cv->color_type == PNG_COLOR_TYPE_PALETTE ? 255 : (1l << cv->bit_depth) - 1) ||
+      (cv->color_type == PNG_COLOR_TYPE_PALETTE && cv->ncomps == 1)) {
+    return;
+  }
+  if (cv->bit_depth == 16) png_set_strip_16(png_ptr);  /* Same as maxval == 65535 in png_mix_scale. */
+  if (cv->color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png_ptr);
+  if (cv->color_type == PNG_COLOR_TYPE_GRAY && cv->bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png_ptr);
+  cv->convert_row = NULL;
+}
+
+/* Reads the next row of a PNG image to out as 8-bit RGB or gray, via png_row if cv->convert_row. */
+static void read_png_rgb_row(png_struct *png_ptr, const struct png_converter *cv, png_byte *png_row, unsigned char *out, png_uint_32 width) {
+  if (cv->convert_row) {
+    png_read_row(png_ptr, png_row, NULL);
+    cv->convert_row(cv, png_row, out, width);
+  } else {
+    png_read_row(png_ptr, out, NULL);
+  }
+}
+
+/*
+ * Returns the largest shift (3, 2, 1, or 0 if none) for which the subimage
+ * of every (1 << shift)th pixel (in both directions) of an interlaced PNG
+ * is at least twice as large as the thumbnail. It is contained by the
+ * first 7 - 2 * shift Adam7 passes. The subimage is point-sampled, so the
+ * factor of 2 leaves some averaging to the resizer, against aliasing.
+ */
+static unsigned get_png_adam7_shift(const struct image *img) {
+  unsigned shift;
+  for (shift = 3; shift > 0; --shift) {
+    if (((img->width + (1U << shift) - 1) >> shift) >= 2 * img->scalewidth &&
+        ((img->height + (1U << shift) - 1) >> shift) >= 2 * img->scaleheight) break;
+  }
+  return shift;
+}
+
+/* Adam7 pass geometry, as PNG_PASS_START_ROW etc. of libpng >= 1.5. */
+static const unsigned char adam7_start_row[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const unsigned char adam7_start_col[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const unsigned char adam7_row_offset[7] = { 8, 8, 8, 4, 4, 2, 2 };
+static const unsigned char adam7_col_offset[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+/* Number of pixels of size in a pass, with the given start and offset. */
+static png_uint_32 get_adam7_pass_size(png_uint_32 size, unsigned start, unsigned offset) {
+  return size > start ? (size - start + offset - 1) / offset : 0;
+}
+
+/*
+ * Reads the first 7 - 2 * shift Adam7 passes of an interlaced PNG (without
+ * png_set_interlace_handling), and assembles the subimage of every
+ * (1 << shift)th pixel in sub, with rows of sub_linesize bytes. row must
+ * be large enough for a row of width pixels of pixel_size bytes: libpng
+ * copies that much, even though a pass has fewer pixels.
+ */
+static void read_png_adam7_subimage(png_struct *png_ptr, png_uint_32 width, png_uint_32 height, unsigned shift,
+                                    unsigned pixel_size, png_byte *sub, size_t sub_linesize, png_byte *row) {
+  int pass;
+  png_uint_32 ncols, nrows, x, y;
+  png_byte *out;
+  for (pass = 0; pass < 7 - 2 * (int)shift; ++pass) {
+    ncols = get_adam7_pass_size(width, adam7_start_col[pass], adam7_col_offset[pass]);
+    nrows = get_adam7_pass_size(height, adam7_start_row[pass], adam7_row_offset[pass]);
+    if (ncols == 0 || nrows == 0) continue;  /* Skipped by libpng. */
+    for (y = 0; y < nrows; ++y) {
+      out = sub + ((adam7_start_row[pass] + y * adam7_row_offset[pass]) >> shift) * sub_linesize;
+      png_read_row(png_ptr, row, NULL);
+      if ((adam7_col_offset[pass] >> shift) == 1) {  /* Whole rows of the subimage. */
+        memcpy(out, row, ncols * pixel_size);
+        continue;
+      }
+      for (x = 0; x < ncols; ++x) {
+        memcpy(out + ((adam7_start_col[pass] + x * adam7_col_offset[pass]) >> shift) * pixel_size,
+               row + x * pixel_size, pixel_size);
+      }
+    }
+  }
+}
+
+/* A non-interlaced PNG decoder streaming its rows, converted to 8-bit RGB. */
+struct png_stream {
+  struct image_stream s;  /* Must be the first. */
+  struct swigpng_jmpbuf_wrapper jmpbuf_struct;
+  struct png_input png_in;
+  png_struct *png_ptr;
+  png_info *info_ptr;
+  struct png_converter cv;
+  png_byte *png_row;  /* Input of cv.convert_row. */
+};
+
+/* Implements image_stream.read_rows, reads 1 row. */
+static unsigned png_stream_read_rows(struct image_stream *s, JSAMPARRAY rows, unsigned n) {
+  struct png_stream *ps = (struct png_stream*)s;
+  (void)n;
+  if (setjmp(ps->jmpbuf_struct.jmpbuf)) return 0;
+  read_png_rgb_row(ps->png_ptr, &ps->cv, ps->png_row, rows[0], s->row_width / ps->cv.ncomps);
+  return 1;
+}
+
+/* Implements image_stream.destroy. */
+static void png_stream_destroy(struct image_stream *s) {
+  struct png_stream *ps = (struct png_stream*)s;
+  png_destroy_read_struct(&ps->png_ptr, &ps->info_ptr, (png_infopp)NULL);
+  free(ps->png_row);
+  free(s->rows);
+}
+
+/* Implements image_stream.finish. */
+static void png_stream_finish(struct image_stream *s) {
+  struct png_stream *ps = (struct png_stream*)s;
+  if (!s->has_error && setjmp(ps->jmpbuf_struct.jmpbuf)) {
+    s->has_error = 1;
+  }
+  if (!s->has_error) {
+    /* Read the rest, so that errors in the compressed data are reported. */
+    for (; s->rows_read < s->height; ++s->rows_read) {
+      read_png_rgb_row(ps->png_ptr, &ps->cv, ps->png_row, s->rows[0], s->row_width / ps->cv.ncomps);
+    }
+    png_read_end(ps->png_ptr, ps->info_ptr);
+  }
+  png_stream_destroy(s);
+}
+
+static char load_image_png(struct image *img, const char *filename, const struct input_file *in) {
   struct swigpng_jmpbuf_wrapper swigpng_jmpbuf_struct;
-  unsigned char sig_buf[4];
+  struct png_input png_in;
   /* Without volatile, `gcc -O3' optimizes away some memory accesses. */
   png_struct * png_ptr;
   png_info * info_ptr;
   /* Without volatile, `gcc -O3' optimizes away some memory accesses. */
   png_byte ** volatile png_image;
   /* Without volatile, `gcc -O3' optimizes away some memory accesses. */
+  png_byte * volatile png_row;
+  /* Without volatile, `gcc -O3' optimizes away some memory accesses. */
+  png_byte * volatile png_sub;
+  /* Without volatile, `gcc -O3' optimizes away some memory accesses. */
   unsigned char * volatile img_data;
-  png_byte *png_pixel;
+  struct png_converter cv;
+  struct png_stream *ps;
+  unsigned nrows, shift, pixel_size;
+  int passes;
   png_uint_32 width;
   png_uint_32 height;
   int bit_depth;
@@ -554,9 +1947,8 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
   png_uint_32 x_pixels_per_unit, y_pixels_per_unit;
   int phys_unit_type;
   int has_phys;
-  int x, y;
+  int y;
   int linesize;
-  png_uint_16 r, g, b, a, pi;
   png_uint_16 trans_r, trans_g, trans_b, trans_gray;
   int i;
   int trans_mix;
@@ -576,16 +1968,18 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
   /* This (alpha channel mixing) works with both RGBA and palette. */
   /* displaygamma = ... */
   png_image = NULL;
+  png_row = NULL;
+  png_sub = NULL;
   img_data = NULL;
 
-  if (fread(sig_buf, 1, sizeof(sig_buf), infile) != sizeof(sig_buf)) {
+  if (in->size < 4) {
     fprintf(stderr, "%s: not a PNG file (empty or too short): %s\n", g_flags.progname, filename);
-    g_flags.exit_code |= 4;
+    add_exit_code(4);
     return 0;
   }
-  if (png_sig_cmp(sig_buf, (png_size_t) 0, (png_size_t) sizeof(sig_buf)) != 0) {
+  if (png_sig_cmp((png_bytep)in->data, (png_size_t) 0, (png_size_t) 4) != 0) {
     fprintf(stderr, "%s: not a PNG file (bad signature): %s\n", g_flags.progname, filename);
-    g_flags.exit_code |= 4;
+    add_exit_code(4);
     return 0;
   }
 
@@ -600,13 +1994,17 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
     png_destroy_read_struct (&png_ptr, &info_ptr, (png_infopp)NULL);
     if (png_image) free(png_image[0]);
     free(png_image);
+    free(png_row);
+    free(png_sub);
     free(img_data); img->data = NULL;  /* This shouldn't be needed. */
-    g_flags.exit_code |= 4;
+    add_exit_code(4);
     return 0;
   }
 
-  png_init_io (png_ptr, infile);
-  png_set_sig_bytes (png_ptr, sizeof(sig_buf));
+  png_in.p = in->data + 4;
+  png_in.end = in->data + in->size;
+  png_set_read_fn (png_ptr, &png_in, png_read_input);
+  png_set_sig_bytes (png_ptr, 4);
   png_read_info (png_ptr, info_ptr);
 
   bit_depth = png_get_bit_depth(png_ptr, info_ptr);
@@ -625,13 +2023,6 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
     return 0;
   }
 
-  if ((img->outfile = fopen(tmp_filename, "wb")) == NULL) {
-    png_destroy_read_struct (&png_ptr, &info_ptr, (png_infopp)NULL);
-    fprintf(stderr, "%s: can't fopen(%s): %s\n", g_flags.progname, tmp_filename, strerror(errno));
-    g_flags.exit_code |= 2;
-    return 0;
-  }
-
   if (png_get_valid(png_ptr, info_ptr, PNG_INFO_bKGD)) {
     png_get_bKGD(png_ptr, info_ptr, &background);
   } else {
@@ -675,8 +2066,6 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
                  &phys_unit_type);
   }
 
-  if (height > 0) check_alloc(png_image = (png_byte **)malloc (height * sizeof (png_byte*)));
-
   if (bit_depth == 16)
     linesize = 2 * width;
   else
@@ -692,7 +2081,7 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
   } else {
     png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
     fprintf(stderr, "%s: unsupported PNG color type: %s: %d\n", g_flags.progname, filename, (int)color_type);
-    g_flags.exit_code |= 4;
+    add_exit_code(4);
     return 0;
   }
 
@@ -741,9 +2130,8 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
           if (!trans_mix)
             break;
         }
-
-        /* else fall though to normal case */
-
+        /* else fall through to normal case */
+        /* fall through */
       case 0:
         if ((color_type == PNG_COLOR_TYPE_PALETTE ||
              color_type == PNG_COLOR_TYPE_RGB ||
@@ -804,356 +2192,1904 @@ static char load_image_png(struct image *img, const char *filename, FILE *infile
         break;
     }
 
-  if (height > 0) {
-    check_alloc(png_image[0] = malloc(linesize * height));
-    for (y = 1 ; y+0U < height ; y++) {
-      png_image[y] = png_image[0] + linesize * y;
-    }
-    png_read_image(png_ptr, png_image);
-    png_read_end(png_ptr, info_ptr);
+  cv.bit_depth = bit_depth;
+  cv.color_type = color_type;
+  cv.maxval = maxval;
+  cv.bgr = bgr;
+  cv.bgg = bgg;
+  cv.bgb = bgb;
+  cv.has_trans = trans_color != NULL;
+  cv.trans_r = trans_r;
+  cv.trans_g = trans_g;
+  cv.trans_b = trans_b;
+  cv.trans_gray = trans_gray;
+  cv.num_palette = num_palette;
+  cv.palette = palette;
+  cv.num_trans = num_trans;
+  cv.trans_alpha = trans_alpha;
+  init_png_converter(&cv);
+  set_png_rgb_transforms(png_ptr, &cv);
+  img->num_components = cv.ncomps;
+  img->colorspace = cv.ncomps == 1 ? JCS_GRAYSCALE : JCS_RGB;
+  shift = 0;
+  if (png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_ADAM7 && !g_flags.full_interlaced) {
+    shift = get_png_adam7_shift(img);
   }
-  /* This sets png_ptr=NULL as a side effect. Also calling it twice is a no-op. */
-  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  /* If shift > 0, png_read_row returns the rows of each pass separately. */
+  passes = shift > 0 ? 7 - 2 * (int)shift : png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
 
   /* if (has_phys & x_pixels_per_unit != y_pixels_per_unit) warning("Non-square pixels."); */
 
-  check_alloc(img_data = img->data = pr = malloc(3 * img->width * img->height * sizeof(unsigned char)));
-  /* TODO(pts): Can't libpng decode directly to RGB, with mixing and gamma correction? Look for png_destroy_read_struct on Google. */
-  for (y = 0 ; y+0U < height ; y++) {
-    png_pixel = png_image[y];
-    for (x = 0 ; x+0U < width ; x++) {
-      r = swigpng_get_png_val(&png_pixel, bit_depth);
-      switch (color_type) {
-        case PNG_COLOR_TYPE_GRAY:
-          g = b = r;
-          a = trans_color && r == trans_gray ? 0 : maxval;
-          break;
-
-        case PNG_COLOR_TYPE_GRAY_ALPHA:
-          g = b = r;
-          a = swigpng_get_png_val(&png_pixel, bit_depth);
-          break;
-
-        case PNG_COLOR_TYPE_PALETTE:
-          pi = r;
-          r = palette[pi].red;
-          g = palette[pi].green;
-          b = palette[pi].blue;
-          a = (int)pi < num_trans ? trans_alpha[pi] : maxval;
-          break;
-
-        case PNG_COLOR_TYPE_RGB:
-          g = swigpng_get_png_val(&png_pixel, bit_depth);
-          b = swigpng_get_png_val(&png_pixel, bit_depth);
-          a = (trans_color && r == trans_r && g == trans_g && b == trans_b) ? 0 : maxval;
-          break;
-
-        case PNG_COLOR_TYPE_RGB_ALPHA:
-        default:  /* Nothing else supported. */
-          g = swigpng_get_png_val(&png_pixel, bit_depth);
-          b = swigpng_get_png_val(&png_pixel, bit_depth);
-          a = swigpng_get_png_val(&png_pixel, bit_depth);
-          break;
+  if (shift > 0) {
+    /* Decode only the first passes. The rest isn't even inflated, so png_read_end is skipped. */
+    img->output_width = (width + (1U << shift) - 1) >> shift;
+    img->output_height = (height + (1U << shift) - 1) >> shift;
+    check_alloc(img_data = img->data = pr = malloc(cv.ncomps * img->output_width * img->output_height * sizeof(unsigned char)));
+    pixel_size = cv.convert_row ? linesize / width : cv.ncomps;
+    check_alloc(png_row = malloc(pixel_size * width));
+    if (!cv.convert_row) {
+      read_png_adam7_subimage(png_ptr, width, height, shift, cv.ncomps, pr, cv.ncomps * img->output_width, png_row);
+    } else {
+      check_alloc(png_sub = malloc(pixel_size * img->output_width * img->output_height));
+      read_png_adam7_subimage(png_ptr, width, height, shift, pixel_size, png_sub, pixel_size * img->output_width, png_row);
+      for (y = 0 ; y+0U < img->output_height ; y++, pr += cv.ncomps * img->output_width) {
+        cv.convert_row(&cv, png_sub + pixel_size * img->output_width * y, pr, img->output_width);
+      }
+    }
+  } else if (g_flags.stream && !g_flags.pipeline && passes == 1) {
+    /* The rows will be read, converted and resized by thumbnail_encode. */
+    check_alloc(ps = malloc(sizeof(*ps)));
+    init_image_stream(&ps->s, in, cv.ncomps * width, height);
+    ps->s.read_rows = png_stream_read_rows;
+    ps->s.finish = png_stream_finish;
+    ps->s.destroy = png_stream_destroy;
+    ps->s.max_read_rows = 1;
+    ps->s.nrows = nrows = resize_window_rows(img->output_width, img->scalewidth);
+    check_alloc(ps->s.rows = malloc(nrows * (sizeof(JSAMPROW) + cv.ncomps * width)));
+    for (y = 0; y+0U < nrows; y++) {
+      ps->s.rows[y] = (JSAMPROW)(ps->s.rows + nrows) + cv.ncomps * width * y;
+    }
+    ps->png_row = NULL;
+    if (cv.convert_row) check_alloc(ps->png_row = malloc(linesize));
+    ps->cv = cv;
+    /* Errors and reads from now on use *ps, which outlives this function. */
+    ps->jmpbuf_struct.filename = filename;
+    png_set_error_fn(png_ptr, &ps->jmpbuf_struct, swigpng_error_handler, NULL);
+    ps->png_in = png_in;
+    png_set_read_fn(png_ptr, &ps->png_in, png_read_input);
+    ps->png_ptr = png_ptr;
+    ps->info_ptr = info_ptr;
+    img->stream = &ps->s;
+    return 1;
+  } else {
+    check_alloc(img_data = img->data = pr = malloc(cv.ncomps * img->width * img->height * sizeof(unsigned char)));
+    if (!cv.convert_row) {
+      /* libpng converts to RGB or gray, directly to img->data, also the Adam7 passes. */
+      for (i = 0; i < passes; i++) {
+        for (y = 0 ; y+0U < height ; y++) {
+          png_read_row(png_ptr, pr + cv.ncomps * width * y, NULL);
+        }
+      }
+    } else if (passes == 1) {
+      check_alloc(png_row = malloc(linesize));
+      for (y = 0 ; y+0U < height ; y++, pr += cv.ncomps * width) {
+        read_png_rgb_row(png_ptr, &cv, png_row, pr, width);
       }
-      if (do_mix && a != maxval) {
-        /* TODO(pts): Convert to maxval=255 first, and only then mix, for better rounding. */
-        r = r * (double)a / maxval + ((1.0 - (double)a / maxval) * bgr);
-        g = g * (double)a / maxval + ((1.0 - (double)a / maxval) * bgg);
-        b = b * (double)a / maxval + ((1.0 - (double)a / maxval) * bgb);
+    } else {
+      /* Interlaced: libpng needs the rows of the previous passes. */
+      check_alloc(png_image = (png_byte **)malloc (height * sizeof (png_byte*)));
+      check_alloc(png_image[0] = malloc(linesize * height));
+      for (y = 1 ; y+0U < height ; y++) {
+        png_image[y] = png_image[0] + linesize * y;
       }
-      if (maxval == 255) {
-      } else if (maxval <= 1) {
-        r *= 255;
-        g *= 255;
-        b *= 255;
-      } else if (maxval == 15) {
-        r *= 17;
-        g *= 17;
-        b *= 17;
-      } else if (maxval == 3) {
-        r *= 85;
-        g *= 85;
-        b *= 85;
-      } else if (maxval == 65535) {  /* 16-bit PNG. */
-        r >>= 8;
-        g >>= 8;
-        b >>= 8;
-      } else {  /* TODO(pts): Can this happen? */
-        r = (png_uint_32)r * 255 / maxval;
-        g = (png_uint_32)g * 255 / maxval;
-        b = (png_uint_32)b * 255 / maxval;
+      png_read_image(png_ptr, png_image);
+      for (y = 0 ; y+0U < height ; y++, pr += cv.ncomps * width) {
+        cv.convert_row(&cv, png_image[y], pr, width);
       }
-      *pr++ = r;
-      *pr++ = g;
-      *pr++ = b;
     }
+    png_read_end(png_ptr, info_ptr);
   }
+  /* palette and trans_alpha point to memory owned by info_ptr, so we can free
+   * it only now. This sets png_ptr=NULL as a side effect. Also calling it
+   * twice is a no-op.
+   */
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
 
   if (png_image) free(png_image[0]);
   free(png_image);
+  free(png_row);
+  free(png_sub);
+  detect_gray_image(img);
   return 1;
 }
 
 /* --- */
 
-/* Called by load_image.
- * Returns whether the scaled image file should be produced.
+/*
+ * Sets the smallest DCT scaling of dinfo whose output is still at least
+ * img->scalewidth x img->scaleheight, so that decoding does most of the downscaling.
  */
-static char load_image_jpeg(struct image *img, const char *filename, FILE *infile, const char *tmp_filename) {
-        struct jpeg_decompress_struct dinfo;
-        struct my_jpeg_error_mgr derrmgr;
-        unsigned char *pr;
-        char has_decompress_started = 0;
-        unsigned row_width;
-        JSAMPARRAY samp;
-	(void)filename;
-
-	dinfo.err = jpeg_std_error(&derrmgr.pub);
-	derrmgr.pub.error_exit = my_jpeg_error_exit;
-	if (setjmp(derrmgr.setjmp_buffer)) {
-		/* If we get here, the JPEG code has signaled a fatal error, which was already printed to stderr in my_jpeg_error_exit.
-		 * Example non-fatal error: Premature end of JPEG file
-		 * Example fatal error: Not a JPEG file: starts with 0x66 0x6f
-		 * TODO(pts): We should report (with fprintf(stderr, ...)) both fatal and non-fatal errors.
-		 * After a non-fatal error, the error is printed to stderr, jpeg_read_scanlines can continue and will return gray pixels.
-		 */
-		if (has_decompress_started) jpeg_finish_decompress(&dinfo);
-		jpeg_destroy_decompress(&dinfo);
-		g_flags.exit_code |= 4;
-		return 0;
+static void set_jpeg_scale(struct jpeg_decompress_struct *dinfo, const struct image *img) {
+#ifdef USE_JPEG_M8_SCALE
+	unsigned m;
+	dinfo->scale_denom = 8;
+	for (m = 1; m < 8; ++m) {
+		dinfo->scale_num = m;
+		jpeg_calc_output_dimensions(dinfo);
+		if (dinfo->output_width >= img->scalewidth && dinfo->output_height >= img->scaleheight) return;
 	}
-	jpeg_create_decompress(&dinfo);
-	jpeg_stdio_src(&dinfo, infile);
-	(void)jpeg_read_header(&dinfo, FALSE);
+	dinfo->scale_num = dinfo->scale_denom = 1;
+#else
+	if (dinfo->image_width >= 8 * img->scalewidth)
+		dinfo->scale_denom = 8;
+	else if (dinfo->image_width >= 4 * img->scalewidth)
+		dinfo->scale_denom = 4;
+	else if (dinfo->image_width >= 2 * img->scalewidth)
+		dinfo->scale_denom = 2;
+#endif
+}
 
-	img->width = dinfo.image_width;
-	img->height = dinfo.image_height;
-	img->num_components = dinfo.num_components;
+/* Sets the DCT scaling of dinfo to m/8. Without USE_JPEG_M8_SCALE, m must be a power of 2. */
+static void set_jpeg_scale_eighths(struct jpeg_decompress_struct *dinfo, unsigned m) {
+#ifdef USE_JPEG_M8_SCALE
+	dinfo->scale_num = m;
+	dinfo->scale_denom = 8;
+#else
+	dinfo->scale_num = 1;
+	dinfo->scale_denom = 8 / m;
+#endif
+}
 
-	if (!compute_scaledims(img, 1)) {
-		jpeg_destroy_decompress(&dinfo);
-		return 0;
+/*
+ * For --draft: sets the DCT scaling of dinfo whose output height is the nearest
+ * to img->scaleheight, and changes the thumbnail size to its output size, so
+ * that no resizing is needed. Returns 0 if even the nearest one is more than
+ * DRAFT_MAX_DEVIATION_PERCENT off, the scaling of dinfo is undefined then.
+ */
+static char snap_jpeg_scale(struct jpeg_decompress_struct *dinfo, struct image *img) {
+	unsigned m, best_m = 0, diff, best_diff = 0;
+	for (m = 1; m <= 8; ++m) {
+#ifndef USE_JPEG_M8_SCALE
+		if (8 % m != 0) continue;
+#endif
+		set_jpeg_scale_eighths(dinfo, m);
+		jpeg_calc_output_dimensions(dinfo);
+		diff = dinfo->output_height > img->scaleheight ?
+		    dinfo->output_height - img->scaleheight : img->scaleheight - dinfo->output_height;
+		if (best_m == 0 || diff < best_diff) {
+			best_m = m;
+			best_diff = diff;
+		}
 	}
+	if (best_diff * 100 > img->scaleheight * DRAFT_MAX_DEVIATION_PERCENT) return 0;
+	set_jpeg_scale_eighths(dinfo, best_m);
+	jpeg_calc_output_dimensions(dinfo);
+	img->scalewidth = dinfo->output_width;
+	img->scaleheight = dinfo->output_height;
+	return 1;
+}
 
-	/*
-	 * If the image is not cached, we need to read it in,
-	 * resize it, and write it out.
-	 */
-	if ((img->outfile = fopen(tmp_filename, "wb")) == NULL) {
-		fprintf(stderr, "%s: can't fopen(%s): %s\n", g_flags.progname, tmp_filename, strerror(errno));
+static void silent_jpeg_output_message(j_common_ptr cinfo) {
+	(void)cinfo;
+}
+
+/* --- Embedded JPEG images: EXIF thumbnail (APP1) and MPF previews (APP2) */
+
+#define MAX_EMBEDDED_JPEGS 8
+
+/* A JPEG image within the input file. */
+struct embedded_jpeg {
+	const unsigned char *data;
+	size_t size;
+};
+
+static unsigned tiff_get16(const unsigned char *p, char is_le) {
+	return is_le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static unsigned long tiff_get32(const unsigned char *p, char is_le) {
+	return is_le ? p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24
+	             : (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Returns the offset of the IFD at offset ifd in the TIFF structure
+ * tiff[:size], or 0 if it's out of bounds. Sets *is_le if ifd == 0 (the
+ * header). Sets *count to the number of its entries, which are in bounds.
+ */
+static unsigned long tiff_ifd(const unsigned char *tiff, size_t size, unsigned long ifd, char *is_le, unsigned *count) {
+	if (ifd == 0) {
+		if (size < 8) return 0;
+		if (0 == memcmp(tiff, "II*\0", 4)) {
+			*is_le = 1;
+		} else if (0 == memcmp(tiff, "MM\0*", 4)) {
+			*is_le = 0;
+		} else {
+			return 0;
+		}
+		ifd = tiff_get32(tiff + 4, *is_le);
+	}
+	if (ifd < 8 || ifd >= size || size - ifd < 2) return 0;
+	*count = tiff_get16(tiff + ifd, *is_le);
+	if ((size - ifd - 2) / 12 < *count) return 0;
+	return ifd;
+}
+
+/* Adds the thumbnail in IFD1 of the EXIF TIFF structure tiff[:size] to found. */
+static unsigned find_exif_thumbnail(const unsigned char *tiff, size_t size, struct embedded_jpeg *found) {
+	unsigned long ifd, offset = 0, length = 0;
+	unsigned count, i;
+	const unsigned char *entry;
+	char is_le;
+
+	if ((ifd = tiff_ifd(tiff, size, 0, &is_le, &count)) == 0 || size - ifd - 2 - 12 * count < 4) return 0;
+	ifd = tiff_get32(tiff + ifd + 2 + 12 * count, is_le);  /* Offset of IFD1. */
+	if (ifd == 0 || (ifd = tiff_ifd(tiff, size, ifd, &is_le, &count)) == 0) return 0;
+	for (i = 0, entry = tiff + ifd + 2; i < count; ++i, entry += 12) {
+		if (tiff_get16(entry, is_le) == 0x201) offset = tiff_get32(entry + 8, is_le);  /* JPEGInterchangeFormat. */
+		if (tiff_get16(entry, is_le) == 0x202) length = tiff_get32(entry + 8, is_le);  /* JPEGInterchangeFormatLength. */
+	}
+	if (offset == 0 || offset >= size || length > size - offset) return 0;
+	found->data = tiff + offset;
+	found->size = length;
+	return 1;
+}
+
+/*
+ * Adds the non-primary images listed in the MP Index IFD of the MPF TIFF
+ * structure tiff[:size] to found[:max]. Their offsets are relative to tiff,
+ * within the file end.
+ */
+static unsigned find_mpf_images(const unsigned char *tiff, size_t size, const unsigned char *end,
+                                struct embedded_jpeg *found, unsigned max) {
+	unsigned long ifd, mp_entries = 0, mp_size = 0, offset, length;
+	unsigned count, i, n = 0;
+	const unsigned char *entry;
+	char is_le;
+
+	if ((ifd = tiff_ifd(tiff, size, 0, &is_le, &count)) == 0) return 0;
+	for (i = 0, entry = tiff + ifd + 2; i < count; ++i, entry += 12) {
+		if (tiff_get16(entry, is_le) == 0xb002) {  /* MPEntry. */
+			mp_size = tiff_get32(entry + 4, is_le);
+			mp_entries = tiff_get32(entry + 8, is_le);
+		}
+	}
+	if (mp_entries == 0 || mp_entries >= size || mp_size > size - mp_entries) return 0;
+	for (entry = tiff + mp_entries; mp_size >= 16 && n < max; mp_size -= 16, entry += 16) {
+		length = tiff_get32(entry + 4, is_le);
+		offset = tiff_get32(entry + 8, is_le);
+		if (offset == 0 || offset >= (size_t)(end - tiff) || length > (size_t)(end - tiff) - offset) continue;
+		found[n].data = tiff + offset;
+		found[n++].size = length;
+	}
+	return n;
+}
+
+/*
+ * Finds the JPEG images embedded to the APP1 (EXIF) and APP2 (MPF) markers
+ * of the JPEG file in, before its SOS marker. Returns their number.
+ */
+static unsigned find_embedded_jpegs(const struct input_file *in, struct embedded_jpeg *found) {
+	const unsigned char *p = in->data + 2, *end = in->data + in->size;  /* Skip SOI. */
+	unsigned n = 0, length;
+
+	while (end - p >= 4 && p[0] == 0xff && n < MAX_EMBEDDED_JPEGS) {
+		if (p[1] == 0xff) {  /* Fill byte. */
+			++p;
+			continue;
+		}
+		if (p[1] == 0xda || p[1] == 0xd9) break;  /* SOS or EOI. */
+		length = p[2] << 8 | p[3];
+		if (length < 2 || (size_t)(end - p - 2) < length) break;
+		if (p[1] == 0xe1 && length >= 8 && 0 == memcmp(p + 4, "Exif\0\0", 6)) {
+			n += find_exif_thumbnail(p + 10, length - 8, found + n);
+		} else if (p[1] == 0xe2 && length >= 6 && 0 == memcmp(p + 4, "MPF\0", 4)) {
+			n += find_mpf_images(p + 8, length - 6, end, found + n, MAX_EMBEDDED_JPEGS - n);
+		}
+		p += 2 + length;
+	}
+	return n;
+}
+
+/* Reads the size of the JPEG image in ej. Returns 0 on error, which is not reported. */
+static char read_embedded_jpeg_size(const struct embedded_jpeg *ej, unsigned *width, unsigned *height) {
+	struct jpeg_decompress_struct dinfo;
+	struct my_jpeg_error_mgr derrmgr;
+
+	if (ej->size < 4 || ej->data[0] != 0xff || ej->data[1] != 0xd8) return 0;
+	dinfo.err = jpeg_std_error(&derrmgr.pub);
+	derrmgr.pub.error_exit = my_jpeg_error_exit;
+	derrmgr.pub.output_message = silent_jpeg_output_message;
+	jpeg_create_decompress(&dinfo);
+	if (setjmp(derrmgr.setjmp_buffer)) {
 		jpeg_destroy_decompress(&dinfo);
-		g_flags.exit_code |= 2;
 		return 0;
 	}
+	jpeg_mem_src(&dinfo, (unsigned char*)ej->data, ej->size);
+	(void)jpeg_read_header(&dinfo, TRUE);
+	*width = dinfo.image_width;
+	*height = dinfo.image_height;
+	jpeg_destroy_decompress(&dinfo);
+	return 1;
+}
 
-	/*
-	 * Use libjpeg's handy feature to downscale the
-	 * original on the fly while reading it in.
-	 */
-	if (img->width >= 8 * img->scalewidth)
-		dinfo.scale_denom = 8;
-	else if (img->width >= 4 * img->scalewidth)
-		dinfo.scale_denom = 4;
-	else if (img->width >= 2 * img->scalewidth)
-		dinfo.scale_denom = 2;
+/*
+ * Finds the smallest JPEG image embedded to in which is smaller than the
+ * main image, is at least img->scaleheight high, and has the same aspect
+ * ratio (within 1%). Returns 0 if there is none.
+ */
+static char find_embedded_jpeg(const struct input_file *in, const struct image *img, struct embedded_jpeg *result) {
+	struct embedded_jpeg found[MAX_EMBEDDED_JPEGS];
+	unsigned n, i, width, height, best_height = 0;
+	unsigned long long a, b;
+
+	n = find_embedded_jpegs(in, found);
+	for (i = 0; i < n; ++i) {
+		if (!read_embedded_jpeg_size(found + i, &width, &height)) continue;
+		if (height < img->scaleheight || height >= img->height || width >= img->width) continue;
+		a = (unsigned long long)width * img->height;
+		b = (unsigned long long)height * img->width;
+		if ((a > b ? a - b : b - a) * 100 > b) continue;
+		if (best_height == 0 || height < best_height) {
+			best_height = height;
+			*result = found[i];
+		}
+	}
+	return best_height != 0;
+}
 
-	has_decompress_started = 1;
+/*
+ * Decodes the JPEG image in src with the default profile (not --draft),
+ * discarding the pixels. Returns 0 on error, which is not reported.
+ */
+static char decode_jpeg_default(const struct embedded_jpeg *src, const struct image *img) {
+	struct jpeg_decompress_struct dinfo;
+	struct my_jpeg_error_mgr derrmgr;
+	JSAMPARRAY rows;
+
+	dinfo.err = jpeg_std_error(&derrmgr.pub);
+	derrmgr.pub.error_exit = my_jpeg_error_exit;
+	derrmgr.pub.output_message = silent_jpeg_output_message;
+	jpeg_create_decompress(&dinfo);
+	if (setjmp(derrmgr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&dinfo);
+		return 0;
+	}
+	jpeg_mem_src(&dinfo, (unsigned char*)src->data, src->size);
+	(void)jpeg_read_header(&dinfo, FALSE);
+	set_jpeg_scale(&dinfo, img);
 	jpeg_start_decompress(&dinfo);
-	img->output_width = dinfo.output_width;
-	img->output_height = dinfo.output_height;
-	img->colorspace = dinfo.out_color_space;
-	row_width = dinfo.output_width * img->num_components;
-	check_alloc(img->data = malloc(row_width * dinfo.output_height * sizeof(unsigned char)));
-	samp = (*dinfo.mem->alloc_sarray)
-	    ((j_common_ptr)&dinfo, JPOOL_IMAGE, row_width, 1);
-
-	/* Read the image into memory. */
-	pr = img->data;
+	rows = (*dinfo.mem->alloc_sarray)
+	    ((j_common_ptr)&dinfo, JPOOL_IMAGE, dinfo.output_width * dinfo.output_components, dinfo.rec_outbuf_height);
 	while (dinfo.output_scanline < dinfo.output_height) {
-		jpeg_read_scanlines(&dinfo, samp, 1);
-		memcpy(pr, *samp, row_width * sizeof(char));
-		pr += row_width;
+		jpeg_read_scanlines(&dinfo, rows, dinfo.rec_outbuf_height);
 	}
 	jpeg_finish_decompress(&dinfo);
 	jpeg_destroy_decompress(&dinfo);
+	return 1;
+}
+
+/* For --draft --stats: returns the wall time of decode_jpeg_default, 0.0 on error. */
+static double time_default_jpeg_decode(const struct embedded_jpeg *src, const struct image *img) {
+	double start = clock_seconds(CLOCK_MONOTONIC);
+	return decode_jpeg_default(src, img) ? clock_seconds(CLOCK_MONOTONIC) - start : 0.0;
+}
+
+/* Natural (row-major) index of the zigzag-ordered DCT coefficients. */
+static const unsigned char jpeg_zigzag_to_natural[DCTSIZE2] = {
+	0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+/* Sample columns and rows per DCT block of a decompressed component, after DCT scaling. */
+#if JPEG_LIB_VERSION >= 70
+#define DCT_SCALED_COLS(comp) ((comp)->DCT_h_scaled_size)
+#define DCT_SCALED_ROWS(comp) ((comp)->DCT_v_scaled_size)
+#define MIN_DCT_SCALED_ROWS(dinfo) ((dinfo)->min_DCT_v_scaled_size)
+#else
+#define DCT_SCALED_COLS(comp) ((comp)->DCT_scaled_size)
+#define DCT_SCALED_ROWS(comp) ((comp)->DCT_scaled_size)
+#define MIN_DCT_SCALED_ROWS(dinfo) ((dinfo)->min_DCT_scaled_size)
+#endif
+
+/*
+ * Returns whether at least the first scan of each DCT coefficient used by
+ * the scaled IDCT of each component has been read. With an IDCT to s x s
+ * pixels, those are the top left s x s coefficients.
+ */
+static char has_scaled_coefficients(j_decompress_ptr dinfo) {
+	int ci, k, s;
+	for (ci = 0; ci < dinfo->num_components; ++ci) {
+		s = DCT_SCALED_COLS(dinfo->comp_info + ci) > DCT_SCALED_ROWS(dinfo->comp_info + ci) ?
+		    DCT_SCALED_COLS(dinfo->comp_info + ci) : DCT_SCALED_ROWS(dinfo->comp_info + ci);
+		for (k = 0; k < DCTSIZE2; ++k) {
+			if (jpeg_zigzag_to_natural[k] / DCTSIZE < s && jpeg_zigzag_to_natural[k] % DCTSIZE < s &&
+			    dinfo->coef_bits[ci][k] < 0) return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * For --partial-progressive: reads the scans of a progressive JPEG in
+ * buffered-image mode until has_scaled_coefficients (typically only DC
+ * and the first AC band for small scales), and starts an output pass.
+ * The low bits of the coefficients from later refinement scans are
+ * missing, so the result differs slightly from the full decode.
+ */
+static void start_partial_output(j_decompress_ptr dinfo) {
+	int ret;
+	do {
+		ret = jpeg_consume_input(dinfo);
+	} while (ret != JPEG_REACHED_EOI && ret != JPEG_SUSPENDED &&
+	         !(ret == JPEG_SCAN_COMPLETED && has_scaled_coefficients(dinfo)));
+	jpeg_start_output(dinfo, dinfo->input_scan_number);
+}
+
+/* Finishes decompression after all scanlines have been read. */
+static void finish_jpeg_decompress(j_decompress_ptr dinfo) {
+	if (dinfo->buffered_image) {
+		/* The rest of the scans are not needed. */
+		jpeg_finish_output(dinfo);
+	} else {
+		jpeg_finish_decompress(dinfo);
+	}
+}
+
+/*
+ * Sampling factors of the components of thumbnails compressed from raw
+ * data: 4:2:0, the libjpeg default for YCbCr.
+ */
+static const int raw_samp_factors[3] = { 2, 1, 1 };
+#define RAW_MAX_SAMP_FACTOR 2
+
+/*
+ * Returns whether dinfo can be decoded as raw YCbCr planes, which can be
+ * resized to the planes of the thumbnail. The chroma planes are subsampled
+ * the same way horizontally and vertically (e.g. 4:2:0 or 4:4:4, but not
+ * 4:2:2), because the resize functions use the same factor for both
+ * directions.
+ */
+static char is_raw_jpeg(j_decompress_ptr dinfo) {
+	int ci;
+	if (dinfo->jpeg_color_space != JCS_YCbCr || dinfo->num_components != 3 ||
+	    dinfo->comp_info[0].h_samp_factor != dinfo->max_h_samp_factor ||
+	    dinfo->comp_info[0].v_samp_factor != dinfo->max_v_samp_factor) return 0;
+	for (ci = 1; ci < 3; ++ci) {
+		if (dinfo->comp_info[ci].h_samp_factor * dinfo->max_v_samp_factor !=
+		    dinfo->comp_info[ci].v_samp_factor * dinfo->max_h_samp_factor) return 0;
+	}
+	return 1;
+}
+
+/* Allocates the samples of planes[0..2], whose sizes are already set. Returns the block to free. */
+static unsigned char *alloc_planes(struct plane *planes) {
+	size_t size = 0;
+	unsigned c;
+	unsigned char *p;
+	for (c = 0; c < 3; ++c) size += (size_t)planes[c].stride * planes[c].nrows;
+	check_alloc(p = malloc(size));
+	for (c = 0, size = 0; c < 3; ++c) {
+		planes[c].data = p + size;
+		size += (size_t)planes[c].stride * planes[c].nrows;
+	}
+	return p;
+}
+
+/*
+ * Sets the sizes of the planes of the raw data of dinfo, after
+ * jpeg_start_decompress. With DCT scaling, libjpeg-turbo scales the chroma
+ * IDCT up rather than upsampling, so the chroma planes may be larger than
+ * the subsampling factors suggest.
+ */
+static void set_decoded_planes(j_decompress_ptr dinfo, struct plane *planes) {
+	const jpeg_component_info *comp;
+	unsigned c;
+	for (c = 0; c < 3; ++c) {
+		comp = dinfo->comp_info + c;
+		planes[c].width = comp->downsampled_width;
+		planes[c].height = comp->downsampled_height;
+		/* Whole MCUs, to be safe. */
+		planes[c].stride = (comp->width_in_blocks + comp->h_samp_factor - 1) / comp->h_samp_factor *
+		    comp->h_samp_factor * DCT_SCALED_COLS(comp);
+		planes[c].nrows = dinfo->total_iMCU_rows * comp->v_samp_factor * DCT_SCALED_ROWS(comp);
+		planes[c].scale_num = comp->h_samp_factor * DCT_SCALED_COLS(comp);
+		planes[c].scale_den = dinfo->comp_info[0].h_samp_factor * DCT_SCALED_COLS(dinfo->comp_info);
+	}
+}
+
+/* Reads the raw data of dinfo to planes[0..2], an iMCU row at a time. */
+static void read_raw_planes(j_decompress_ptr dinfo, const struct plane *planes) {
+	JSAMPROW rows[3][MAX_SAMP_FACTOR * DCTSIZE];
+	JSAMPARRAY bufs[3];
+	const unsigned lines = dinfo->max_v_samp_factor * MIN_DCT_SCALED_ROWS(dinfo);
+	unsigned c, i, n, y;
+
+	for (y = 0; dinfo->output_scanline < dinfo->output_height; ++y) {
+		for (c = 0; c < 3; ++c) {
+			n = dinfo->comp_info[c].v_samp_factor * DCT_SCALED_ROWS(dinfo->comp_info + c);
+			for (i = 0; i < n; ++i) rows[c][i] = planes[c].data + (size_t)(y * n + i) * planes[c].stride;
+			bufs[c] = rows[c];
+		}
+		jpeg_read_raw_data(dinfo, bufs, lines);
+	}
+}
+
+/* Called by load_image.
+ * Returns whether the scaled image file should be produced.
+ */
+/* Implements image_stream.read_rows. */
+static unsigned jpeg_stream_read_rows(struct image_stream *s, JSAMPARRAY rows, unsigned n) {
+	struct jpeg_stream *js = (struct jpeg_stream*)s;
+	if (setjmp(js->derrmgr.setjmp_buffer)) return 0;
+	return jpeg_read_scanlines(&js->dinfo, rows, n);
+}
+
+/* Implements image_stream.destroy. */
+static void jpeg_stream_destroy(struct image_stream *s) {
+	jpeg_destroy_decompress(&((struct jpeg_stream*)s)->dinfo);
+}
+
+/* Implements image_stream.finish. */
+static void jpeg_stream_finish(struct image_stream *s) {
+	struct jpeg_stream *js = (struct jpeg_stream*)s;
+	if (!s->has_error && setjmp(js->derrmgr.setjmp_buffer)) {
+		s->has_error = 1;
+	}
+	if (!s->has_error) {
+		/* Read the rest, so that warnings about corrupt data are reported. */
+		while (js->dinfo.output_scanline < js->dinfo.output_height) {
+			jpeg_read_scanlines(&js->dinfo, s->rows, s->nrows);
+		}
+		finish_jpeg_decompress(&js->dinfo);
+	}
+	jpeg_destroy_decompress(&js->dinfo);
+}
+
+static char load_image_jpeg(struct image *img, const char *filename, const struct input_file *in) {
+        struct jpeg_stream *js;
+        unsigned char *pr;
+        char has_decompress_started = 0;
+        unsigned row_width, y;
+        JSAMPARRAY rows;
+        struct embedded_jpeg src;
+	(void)filename;
+
+	/* On the heap, because it outlives this function if streaming. */
+	check_alloc(js = malloc(sizeof(*js)));
+	js->dinfo.err = jpeg_std_error(&js->derrmgr.pub);
+	js->derrmgr.pub.error_exit = my_jpeg_error_exit;
+	if (setjmp(js->derrmgr.setjmp_buffer)) {
+		/* If we get here, the JPEG code has signaled a fatal error, which was already printed to stderr in my_jpeg_error_exit.
+		 * Example non-fatal error: Premature end of JPEG file
+		 * Example fatal error: Not a JPEG file: starts with 0x66 0x6f
+		 * TODO(pts): We should report (with fprintf(stderr, ...)) both fatal and non-fatal errors.
+		 * After a non-fatal error, the error is printed to stderr, jpeg_read_scanlines can continue and will return gray pixels.
+		 */
+		if (has_decompress_started && !js->dinfo.buffered_image) jpeg_finish_decompress(&js->dinfo);
+		jpeg_destroy_decompress(&js->dinfo);
+		free(js);
+		add_exit_code(4);
+		return 0;
+	}
+	jpeg_create_decompress(&js->dinfo);
+	jpeg_mem_src(&js->dinfo, (unsigned char*)in->data, in->size);
+	(void)jpeg_read_header(&js->dinfo, FALSE);
+
+	img->width = js->dinfo.image_width;
+	img->height = js->dinfo.image_height;
+	img->num_components = js->dinfo.num_components;
+
+	if (!compute_scaledims(img, 1)) {
+		jpeg_destroy_decompress(&js->dinfo);
+		free(js);
+		return 0;
+	}
+
+	/*
+	 * Decode an embedded thumbnail or preview instead if it's large enough.
+	 * img->width and img->height remain those of the main image.
+	 */
+	src.data = in->data;
+	src.size = in->size;
+	if (!g_flags.no_embedded && find_embedded_jpeg(in, img, &src)) {
+		jpeg_abort_decompress(&js->dinfo);
+		jpeg_mem_src(&js->dinfo, (unsigned char*)src.data, src.size);
+		(void)jpeg_read_header(&js->dinfo, TRUE);
+		img->num_components = js->dinfo.num_components;
+	}
+
+	if (g_flags.draft && g_flags.stats) {
+		/* Not included in the decode time. */
+		stats_stop(&img->stats, ST_DECODE);
+		img->stats.default_decode_wall = time_default_jpeg_decode(&src, img);
+		stats_start(&img->stats);
+	}
+
+	/*
+	 * Use libjpeg's handy feature to downscale the
+	 * original on the fly while reading it in.
+	 */
+	if (g_flags.draft) {
+		js->dinfo.dct_method = JDCT_IFAST;
+		js->dinfo.do_fancy_upsampling = FALSE;
+		js->dinfo.do_block_smoothing = FALSE;
+	}
+	if (!g_flags.draft || !snap_jpeg_scale(&js->dinfo, img)) set_jpeg_scale(&js->dinfo, img);
+	img->stats.scale_eighths = 8 * js->dinfo.scale_num / js->dinfo.scale_denom;
+	if (g_flags.partial_progressive && js->dinfo.progressive_mode &&
+	    js->dinfo.scale_num < js->dinfo.scale_denom) {
+		js->dinfo.buffered_image = TRUE;
+	}
+	/*
+	 * Keep the Y, Cb and Cr planes: no color conversion and upsampling.
+	 * Not with -l and -F: their point sampling and rounding down would be
+	 * visible in the chroma planes.
+	 */
+	if (!g_flags.no_raw && !(g_flags.stream && !g_flags.pipeline) &&
+	    !g_flags.bilinear && !g_flags.float_resize && is_raw_jpeg(&js->dinfo)) {
+		js->dinfo.raw_data_out = TRUE;
+		img->is_raw = 1;
+	}
+	has_decompress_started = 1;
+	jpeg_start_decompress(&js->dinfo);
+	if (js->dinfo.buffered_image) start_partial_output(&js->dinfo);
+	img->output_width = js->dinfo.output_width;
+	img->output_height = js->dinfo.output_height;
+	img->colorspace = js->dinfo.out_color_space;
+	row_width = js->dinfo.output_width * img->num_components;
+
+	if (img->is_raw) {
+		img->colorspace = JCS_YCbCr;
+		set_decoded_planes(&js->dinfo, img->planes);
+		img->data = alloc_planes(img->planes);
+		read_raw_planes(&js->dinfo, img->planes);
+		finish_jpeg_decompress(&js->dinfo);
+		jpeg_destroy_decompress(&js->dinfo);
+		free(js);
+		return 1;
+	}
+
+	if (g_flags.stream && !g_flags.pipeline) {
+		/* The scanlines will be read by thumbnail_encode. */
+		init_image_stream(&js->s, in, row_width, js->dinfo.output_height);
+		js->s.read_rows = jpeg_stream_read_rows;
+		js->s.finish = jpeg_stream_finish;
+		js->s.destroy = jpeg_stream_destroy;
+		/* jpeg_read_scanlines may return up to rec_outbuf_height rows at once. */
+		js->s.max_read_rows = js->dinfo.rec_outbuf_height;
+		js->s.nrows = resize_window_rows(img->output_width, img->scalewidth) + js->s.max_read_rows - 1;
+		js->s.rows = (*js->dinfo.mem->alloc_sarray)
+		    ((j_common_ptr)&js->dinfo, JPOOL_IMAGE, row_width, js->s.nrows);
+		img->stream = &js->s;
+		return 1;
+	}
+
+	check_alloc(img->data = malloc(row_width * js->dinfo.output_height * sizeof(unsigned char)));
+	rows = (JSAMPARRAY)(*js->dinfo.mem->alloc_small)
+	    ((j_common_ptr)&js->dinfo, JPOOL_IMAGE, js->dinfo.output_height * sizeof(JSAMPROW));
+	for (pr = img->data, y = 0; y < js->dinfo.output_height; ++y, pr += row_width) {
+		rows[y] = pr;
+	}
+
+	/* Read the image into memory, directly to img->data, up to rec_outbuf_height rows per call. */
+	while (js->dinfo.output_scanline < js->dinfo.output_height) {
+		jpeg_read_scanlines(&js->dinfo, rows + js->dinfo.output_scanline,
+		                    js->dinfo.output_height - js->dinfo.output_scanline);
+	}
+	finish_jpeg_decompress(&js->dinfo);
+	jpeg_destroy_decompress(&js->dinfo);
+	free(js);
 	/* if (setjmp(...)) above can't happen anymore. */
 	return 1;
 }
 
+/* Frees img->stream without reading the rest of it. */
+static void image_stream_abort(struct image *img) {
+	struct image_stream *s = img->stream;
+	s->destroy(s);
+	close_input_file(&s->input);
+	free(s);
+	img->stream = NULL;
+}
+
 /* Returns whether the scaled image file should be produced. */
-static char load_image(struct image *img, const char *filename, const char *tmp_filename) {
-	FILE *infile;
-	char header[24];
+static char load_image(struct image *img, struct input_entry *entry) {
+	const char *filename = entry->filename;
+	struct input_file in;
 	imgfmt_t fmt;
-	unsigned header_size;
 	char result;
 
 	img->data = NULL;
+	img->is_raw = 0;
 	img->outfile = NULL;
+	img->stream = NULL;
 
 	/*
-	 * Open the file and get some basic image information.
+	 * Map the file, and detect its format from the first few bytes (unless
+	 * scan_dir has already done so). The decoders read from the same mapping.
 	 */
-	if ((infile = fopen(filename, "rb")) == NULL) {
-		fprintf(stderr, "%s: can't fopen(%s): %s\n", g_flags.progname, filename, strerror(errno));
-		g_flags.exit_code |= 2;
+	if (!open_input_entry(&in, entry)) {
+		fprintf(stderr, "%s: can't open(%s): %s\n", g_flags.progname, filename, strerror(errno));
+		add_exit_code(2);
 		return 0;
 	}
 
-	header_size = fread(header, sizeof(char), sizeof(header), infile);
-	if (ferror(infile)) {
-		fprintf(stderr, "%s: can't read headers from %s: %s\n", g_flags.progname, filename, strerror(errno));
-		g_flags.exit_code |= 2;
-		result = 0;
-	} else if (fseek(infile, 0, SEEK_SET) != 0) {
-		fprintf(stderr, "%s: can't seek in %s: %s\n", g_flags.progname, filename, strerror(errno));
-		g_flags.exit_code |= 2;
-		result = 0;
-	} else if ((fmt = detect_image_format(header, header_size)) == IF_UNKNOWN) { do_unknown:
-		/* This code is not reached for non-image files in a recursively scanned dir, detect_image_format was called earlier. */
-		if (header_size == 0) {
+	if ((fmt = entry->format) == IF_UNKNOWN &&
+	    (fmt = detect_image_format((const char*)in.data, in.size < 24 ? in.size : 24)) == IF_UNKNOWN) { do_unknown:
+		/* This code is not reached for non-image files in a recursively scanned dir (without --no-sniff), detect_image_format was called earlier. */
+		if (in.size == 0) {
 			fprintf(stderr, "%s: empty image file: %s\n", g_flags.progname, filename);
 		} else {
 			fprintf(stderr, "%s: unknown image file format: %s\n", g_flags.progname, filename);
 		}
-		g_flags.exit_code |= 8;
+		add_exit_code(8);
 		result = 0;
-	} else if (fmt == IF_JPEG) {
-		result = load_image_jpeg(img, filename, infile, tmp_filename);
-	} else if (fmt == IF_PNG) {
-		result = load_image_png(img, filename, infile, tmp_filename);
-	} else if (fmt == IF_GIF) {
-		result = load_image_gif(img, filename, infile, tmp_filename);
 	} else {
-		goto do_unknown;  /* Shouldn't happen. */
+		img->stats.format = fmt;
+		stats_stop(&img->stats, ST_OPEN);
+		if (fmt == IF_JPEG) {
+			result = load_image_jpeg(img, filename, &in);
+		} else if (fmt == IF_PNG) {
+			result = load_image_png(img, filename, &in);
+		} else if (fmt == IF_GIF) {
+			result = load_image_gif(img, filename, &in);
+		} else {
+			goto do_unknown;  /* Shouldn't happen. */
+		}
 	}
-	fclose(infile);
+	if (!img->stream) close_input_file(&in);  /* Else closed by image_stream_finish. */
 	return result;
 }
 
-static void create_thumbnail(char *filename) {
+/* Returns whether filename is a thumbnail: *.th.jpg or *.th<height>.jpg. */
+static char is_thumbnail_filename(const char *filename) {
+	const char *r = filename + strlen(filename);
+	const char *p = r - 4;
+	if (r - filename < 7 || 0 != memcmp(p, ".jpg", 4 * sizeof(char))) return 0;
+	for (; p - filename > 3 && isdigit((unsigned char)p[-1]); --p) {}
+	return 0 == memcmp(p - 3, ".th", 3 * sizeof(char));
+}
+
+/* Writes the thumbnail filename of filename for height g_flags.scaleheights[i]
+ * to final, which must have room for strlen(filename) + THUMBNAIL_SUFFIX_SIZE
+ * bytes.
+ * Returns 0 if filename is already a thumbnail.
+ */
+static char get_thumbnail_filename(const char *filename, unsigned i, char *final) {
+	const char* r = filename + strlen(filename);
+	const char* p = r;
+	size_t prefixlen;
+	if (is_thumbnail_filename(filename))
+		return 0;  /* Already a thumbnail. */
+
+	/* Replace image extension with .th.jpg (or .th<height>.jpg), save result to final. */
+	for (; p != filename && p[-1] != '/' && p[-1] != '.'; --p) {}
+	prefixlen = (p != filename && p[-1] == '.') ? p - filename - 1 : r - filename;
+	memcpy(final, filename, prefixlen * sizeof(char));
+	if (g_flags.nscaleheights > 1) {
+		sprintf(final + prefixlen, ".th%d.jpg", g_flags.scaleheights[i]);
+	} else {
+		strcpy(final + prefixlen, ".th.jpg");
+	}
+	return 1;
+}
+
+/* One of the sizes (-H) of a thumbnail. */
+struct thumbnail_size {
 	/* TODO(pts): Don't use MAXPATHLEN. */
-	char final[MAXPATHLEN], tmp_filename[MAXPATHLEN];
-	void (*resize_func)(unsigned num_components, unsigned output_width, unsigned output_height, unsigned, unsigned, const unsigned char *p, unsigned char *o);
-	struct stat sb;
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr cerr;
+	char final[MAXPATHLEN], tmp_filename[MAXPATHLEN + 4];
+	struct image img;
+};
+
+/* State of one thumbnail being created, passed between the stages. */
+struct thumbnail {
+	struct input_entry *entry;
+	char *filename;  /* entry->filename. */
+	/*
+	 * The sizes to be produced, largest first. sizes[0].img is decoded, the
+	 * others are resized from the previous size.
+	 */
+	struct thumbnail_size sizes[MAX_THUMBNAIL_SIZES];
+	int heights[MAX_THUMBNAIL_SIZES];  /* Of sizes. */
+	unsigned nsizes;
+	struct task_group *group;  /* Used by the -P pipeline only. */
+};
+
+/* Sets the size of img, to be resized from prev, a larger thumbnail of the same image. */
+static void set_smaller_size(struct image *img, const struct image *prev, const int *height) {
+	*img = *prev;
+	img->output_width = prev->scalewidth;
+	img->output_height = prev->scaleheight;
+	img->heights = height;
+	img->nheights = 1;
+	(void)compute_scaledims(img, 0);
+	img->data = NULL;  /* Set by thumbnail_resize. */
+	img->outfile = NULL;
+	memset(&img->stats, 0, sizeof(img->stats));
+}
+
+/*
+ * Stage 1 of creating a thumbnail: checks the cache of each size, loads the
+ * image to th->sizes[0].img.data (decoded for the largest size which is not
+ * cached) and opens the tmp files.
+ * Returns whether the scaled image files should be produced. If not,
+ * everything has already been cleaned up.
+ */
+static char thumbnail_decode(struct thumbnail *th) {
+	struct input_entry *entry = th->entry;
+	struct image *img = &th->sizes[0].img;
+	struct thumbnail_size *size;
+	struct image decoded;
+	unsigned i, nskipped;
+
+	img->data = NULL;
+	img->outfile = NULL;
+	img->stream = NULL;
+	memset(&img->stats, 0, sizeof(img->stats));
+	stats_start(&img->stats);
+	if (strlen(th->filename) + THUMBNAIL_SUFFIX_SIZE > MAXPATHLEN) {
+		fprintf(stderr, "%s: filename too long: %s\n", g_flags.progname, th->filename);
+		add_exit_code(2);
+		goto do_skip;
+	}
+	/* scan_dir has already stat()ed most files. */
+	if (!entry->has_stat) {
+		if (stat(th->filename, &entry->sb)) {
+			fprintf(stderr, "%s: can't stat(%s): %s\n", g_flags.progname,
+			    th->filename, strerror(errno));
+			add_exit_code(2);
+			goto do_skip;
+		}
+		entry->has_stat = 1;
+	}
+
+	/*
+	 * Check if the cached images exist and are newer than the
+	 * original.
+	 */
+	for (th->nsizes = i = 0; i < g_flags.nscaleheights; ++i) {
+		size = th->sizes + th->nsizes;
+		if (!get_thumbnail_filename(th->filename, i, size->final)) goto do_skip;
+		if (!g_flags.force && check_cache(size->final, &entry->sb)) continue;
+		sprintf(size->tmp_filename, "%.*s.tmp", MAXPATHLEN - 1, size->final);
+		th->heights[th->nsizes++] = g_flags.scaleheights[i];
+	}
+	if (th->nsizes == 0) goto do_skip;
+
+	img->heights = th->heights;
+	img->nheights = th->nsizes;
+	img->stats.input_size = entry->sb.st_size;
+	if (!load_image(img, entry)) {
+		free(img->data);
+		img->data = NULL;
+		return 0;
+	}
+	stats_stop(&img->stats, ST_DECODE);
+	if ((nskipped = th->nsizes - img->nheights) > 0) {
+		/* Drop the sizes which are larger than the image, see compute_scaledims. */
+		decoded = *img;
+		th->nsizes -= nskipped;
+		memmove(th->sizes, th->sizes + nskipped, th->nsizes * sizeof(th->sizes[0]));
+		memmove(th->heights, th->heights + nskipped, th->nsizes * sizeof(th->heights[0]));
+		*img = decoded;
+		img->heights = th->heights;
+	}
+
+	for (i = 0; i < th->nsizes; ++i) {
+		size = th->sizes + i;
+		if (i > 0) set_smaller_size(&size->img, &size[-1].img, th->heights + i);
+		if ((size->img.outfile = fopen(size->tmp_filename, "wb")) == NULL) {
+			fprintf(stderr, "%s: can't fopen(%s): %s\n", g_flags.progname, size->tmp_filename, strerror(errno));
+			add_exit_code(2);
+			while (i-- > 0) {
+				fclose(th->sizes[i].img.outfile);
+				unlink(th->sizes[i].tmp_filename);
+			}
+			if (img->stream) image_stream_abort(img);
+			free(img->data);
+			img->data = NULL;
+			return 0;
+		}
+	}
+	return 1;
+ do_skip:
+	close_entry_fd(entry);
+	return 0;
+}
+
+/*
+ * Row access for the resize functions, so that they can work both on
+ * images in memory and on scanlines streamed from the decoder to the
+ * encoder (-S). Within a call to a resize function, get_in_row is never
+ * called with a row number smaller than the largest one so far minus
+ * resize_window_rows() - 1, and only that many of the last rows returned
+ * by it are used.
+ */
+struct resize_io {
+	unsigned num_components;
+	unsigned output_width, output_height;  /* Input size. */
+	unsigned out_width, out_height;  /* Output size. */
+	/* Scale factor in both directions, usually out_width / output_width. */
+	unsigned factor_num, factor_den;
+	const unsigned char *(*get_in_row)(const struct resize_io *io, unsigned y);
+	unsigned char *(*get_out_row)(const struct resize_io *io, unsigned y);
+	/* Called when output row y is complete. May be NULL. */
+	void (*put_out_row)(const struct resize_io *io, unsigned y);
+	const unsigned char *in_data;
+	unsigned char *out_data;
+	size_t in_stride, out_stride;  /* Bytes per row of in_data and out_data. */
+	void *ctx;
+};
+
+static const unsigned char *memory_get_in_row(const struct resize_io *io, unsigned y) {
+	if (y >= io->output_height) y = io->output_height - 1;
+	return io->in_data + y * io->in_stride;
+}
+
+static unsigned char *memory_get_out_row(const struct resize_io *io, unsigned y) {
+	return io->out_data + y * io->out_stride;
+}
+
+static void init_resize_io(struct resize_io *io, const struct image *img) {
+	io->num_components = img->num_components;
+	io->output_width = img->output_width;
+	io->output_height = img->output_height;
+	io->out_width = img->scalewidth;
+	io->out_height = img->scaleheight;
+	io->factor_num = img->scalewidth;
+	io->factor_den = img->output_width;
+	io->get_in_row = memory_get_in_row;
+	io->get_out_row = memory_get_out_row;
+	io->put_out_row = NULL;
+	io->in_data = img->data;
+	io->out_data = NULL;
+	io->in_stride = (size_t)img->output_width * img->num_components;
+	io->out_stride = (size_t)img->scalewidth * img->num_components;
+	io->ctx = NULL;
+}
+
+typedef void (*resize_func_t)(const struct resize_io *io, unsigned y_begin, unsigned y_end);
+
+/* Returns the resize function selected by the command-line flags. */
+static resize_func_t get_resize_func(void) {
+	if (g_flags.bilinear) return g_flags.float_resize ? resize_bilinear : resize_bilinear_fixed;
+	return g_flags.float_resize && g_flags.filter == RF_BOX ? resize_bicubic : resize_separable;
+}
+
+/* Images with at least this many input pixels are resized in parallel. */
+#ifndef PARALLEL_RESIZE_MIN_PIXELS
+#define PARALLEL_RESIZE_MIN_PIXELS (16UL << 20)
+#endif
+
+/* A horizontal band of output rows, resized as a pool task. */
+struct resize_band {
+	resize_func_t resize_func;
+	const struct resize_io *io;
+	unsigned y_begin, y_end;
+};
+
+static void run_resize_band(void *arg) {
+	const struct resize_band *band = (const struct resize_band*)arg;
+	band->resize_func(band->io, band->y_begin, band->y_end);
+}
+
+/*
+ * Resizes in memory, from io->in_data to io->out_data. Large images are
+ * split to bands of output rows, which are submitted to the pool, so that
+ * idle threads can steal them. The result is identical to resizing in one
+ * go. Small images are resized in the current thread, they are
+ * parallelized by process_files.
+ */
+static void resize_image(resize_func_t resize_func, const struct resize_io *io) {
+	struct resize_band *bands;
+	struct task_group group;
+	unsigned nbands, i;
+
+	if (g_pool.nthreads == 0 || io->out_height < 2 ||
+	    (unsigned long)io->output_width * io->output_height < PARALLEL_RESIZE_MIN_PIXELS) {
+		resize_func(io, 0, io->out_height);
+		return;
+	}
+	/* More bands than threads, for load balancing. */
+	nbands = 4 * (g_pool.nthreads + 1);
+	if (nbands > io->out_height) nbands = io->out_height;
+	check_alloc(bands = malloc(nbands * sizeof(*bands)));
+	group.pending = 0;
+	for (i = 0; i < nbands; ++i) {
+		bands[i].resize_func = resize_func;
+		bands[i].io = io;
+		bands[i].y_begin = (unsigned long)io->out_height * i / nbands;
+		bands[i].y_end = (unsigned long)io->out_height * (i + 1) / nbands;
+		pool_submit(&group, run_resize_band, bands + i);
+	}
+	pool_wait(&group);
+	free(bands);
+}
+
+/* Returns whether the image has to be resized (rather than just copied). */
+static char needs_resize(const struct image *img) {
+	/* Typically, if img->output_width == img->scalewidth, then the heights are also the same.
+	 * A notable excaption when it is +1: input JPEG 700x961, -H 480, img->scale_denom=2, img->output_width=350 img->output_height=481.
+	 * In the +1 case, we ignore the last input row.
+	 */
+	return !(img->output_width == img->scalewidth &&
+	    (img->output_height == img->scaleheight || img->output_height == img->scaleheight + 1));
+}
+
+/*
+ * Sets the sizes of the planes compressed by write_raw_planes for a
+ * width x height thumbnail, padded to full MCUs.
+ */
+static void set_raw_planes(struct plane *planes, unsigned width, unsigned height) {
+	const unsigned mcu_size = RAW_MAX_SAMP_FACTOR * DCTSIZE;
+	unsigned c, f;
+	for (c = 0; c < 3; ++c) {
+		f = raw_samp_factors[c];
+		planes[c].width = (width * f + RAW_MAX_SAMP_FACTOR - 1) / RAW_MAX_SAMP_FACTOR;
+		planes[c].height = (height * f + RAW_MAX_SAMP_FACTOR - 1) / RAW_MAX_SAMP_FACTOR;
+		planes[c].stride = (width + mcu_size - 1) / mcu_size * f * DCTSIZE;
+		planes[c].nrows = (height + mcu_size - 1) / mcu_size * f * DCTSIZE;
+		planes[c].scale_num = f;
+		planes[c].scale_den = RAW_MAX_SAMP_FACTOR;
+	}
+}
+
+/*
+ * Resizes (or copies) plane in of img to plane out, and fills the padding
+ * of out by replicating its last column and row, like libjpeg does for the
+ * scanlines it compresses. The scale factor is that of the image, adjusted
+ * by the plane scales, rather than computed from the (rounded) plane sizes.
+ */
+static void resize_plane(resize_func_t resize_func, const struct image *img,
+                         const struct plane *in, const struct plane *out) {
+	struct resize_io io;
+	unsigned char *p;
+	unsigned y;
+
+	io.factor_num = img->scalewidth * out->scale_num * in->scale_den;
+	io.factor_den = img->output_width * out->scale_den * in->scale_num;
+	/* Like needs_resize. */
+	if (io.factor_num == io.factor_den && in->width == out->width &&
+	    (in->height == out->height || in->height == out->height + 1)) {
+		for (y = 0; y < out->height; ++y) {
+			memcpy(out->data + (size_t)y * out->stride, in->data + (size_t)y * in->stride, out->width);
+		}
+	} else {
+		io.num_components = 1;
+		io.output_width = in->width;
+		io.output_height = in->height;
+		io.out_width = out->width;
+		io.out_height = out->height;
+		io.get_in_row = memory_get_in_row;
+		io.get_out_row = memory_get_out_row;
+		io.put_out_row = NULL;
+		io.in_data = in->data;
+		io.out_data = out->data;
+		io.in_stride = in->stride;
+		io.out_stride = out->stride;
+		io.ctx = NULL;
+		resize_image(resize_func, &io);
+	}
+	for (y = 0; y < out->height; ++y) {
+		p = out->data + (size_t)y * out->stride;
+		memset(p + out->width, p[out->width - 1], out->stride - out->width);
+	}
+	for (p = out->data + (size_t)(y - 1) * out->stride; y < out->nrows; ++y) {
+		memcpy(out->data + (size_t)y * out->stride, p, out->stride);
+	}
+}
+
+/*
+ * Stage 2 for img->is_raw: resizes the decoded planes to the planes of the
+ * thumbnail. Frees the decoded planes unless keep_input.
+ */
+static void thumbnail_resize_planes(struct image *img, char keep_input) {
+	struct plane planes[3];
+	unsigned char *o;
+	unsigned c;
+
+	stats_start(&img->stats);
+	set_raw_planes(planes, img->scalewidth, img->scaleheight);
+	o = alloc_planes(planes);
+	for (c = 0; c < 3; ++c) resize_plane(get_resize_func(), img, img->planes + c, planes + c);
+	if (!keep_input) free(img->data);
+	img->data = o;
+	memcpy(img->planes, planes, sizeof(planes));
+	stats_stop(&img->stats, ST_RESIZE);
+}
+
+/*
+ * Resizes img->data in place. If keep_input, img->data is not freed, and
+ * it is copied even if it doesn't need resizing.
+ */
+static void resize_thumbnail_image(struct image *img, char keep_input) {
+	struct resize_io io;
 	unsigned char *o;
-	struct image imgs, *img = &imgs;
 	unsigned img_datasize;
-	JSAMPROW row_pointer[1];
 
-	printf("Image %s\n", filename);
-	fflush(stdout);
-	if (stat(filename, &sb)) {
-		fprintf(stderr, "%s: can't stat(%s): %s\n", g_flags.progname,
-		    filename, strerror(errno));
-		g_flags.exit_code |= 2;
+	if (img->is_raw) {
+		thumbnail_resize_planes(img, keep_input);
+		return;
+	}
+	if (img->stream) return;
+	img_datasize = img->scalewidth * img->scaleheight * img->num_components;
+	if (!needs_resize(img)) {
+		if (keep_input) {
+			check_alloc(o = malloc(img_datasize * sizeof(unsigned char)));
+			memcpy(o, img->data, img_datasize * sizeof(unsigned char));
+			img->data = o;
+		}
 		return;
 	}
+	stats_start(&img->stats);
+#if 0
+	fprintf(stderr, "img->scalewidth=%d img->scaleheight=%d img->num_components=%d img_datasize=%d\n", img->scalewidth, img->scaleheight, img->num_components, img_datasize);
+	fprintf(stderr, "img->output_width=%d img->output_height=%d s_row_width=%d\n", img->output_width, img->output_height, img->output_width * img->num_components);
+#endif
+	check_alloc(o = malloc(img_datasize * sizeof(unsigned char)));
+	init_resize_io(&io, img);
+	io.out_data = o;
+	resize_image(get_resize_func(), &io);
+	if (!keep_input) free(img->data);
+	img->data = o;
+	stats_stop(&img->stats, ST_RESIZE);
+}
 
-	{  /* Generate thumbnail filename. */
-		const char* r = filename + strlen(filename);
-		const char* p = r;
-		size_t prefixlen;
-		if (r - filename >= 7 && 0 == memcmp(r - 7, ".th.jpg", 7 * sizeof(char)))
-			return;  /* Already a thumbnail. */
+/*
+ * Stage 2 of creating a thumbnail: resizes th->sizes[0].img.data in place,
+ * and each smaller size from the previous one, which is kept.
+ * Streamed images (-S) are resized by thumbnail_encode instead.
+ */
+static void thumbnail_resize(struct thumbnail *th) {
+	struct image *img;
+	const struct image *prev;
+	unsigned i;
 
-		/* Replace image extension with .th.jpg, save result to th_filename */
-		for (; p != filename && p[-1] != '/' && p[-1] != '.'; --p) {}
-		prefixlen = (p != filename && p[-1] == '.') ? p - filename - 1 : r - filename;
-		memcpy(final, filename, prefixlen * sizeof(char));
-		strcpy(final + prefixlen, ".th.jpg");
-		sprintf(tmp_filename, "%s.tmp", final);
+	for (i = 0; i < th->nsizes; ++i) {
+		img = &th->sizes[i].img;
+		if (i > 0) {
+			prev = &th->sizes[i - 1].img;
+			img->data = prev->data;
+			memcpy(img->planes, prev->planes, sizeof(img->planes));
+		}
+		resize_thumbnail_image(img, i > 0);
+	}
+}
+
+/* Reads the next scanline(s) of s to s->rows, up to max_read_rows at once. */
+static void image_stream_read_row(struct image_stream *s) {
+	unsigned i = s->rows_read % s->nrows;
+	unsigned n = s->nrows - i;
+	if (n > s->max_read_rows) n = s->max_read_rows;
+	if (n > s->height - s->rows_read) n = s->height - s->rows_read;
+	if (!s->has_error) {
+		if ((n = s->read_rows(s, s->rows + i, n)) > 0) {
+			s->rows_read += n;
+			return;
+		}
+		/* Fatal error, already printed. Continue with black rows, the
+		 * output file will be discarded by image_stream_finish.
+		 */
+		s->has_error = 1;
+	}
+	memset(s->rows[i], 0, s->row_width);
+	++s->rows_read;
+}
+
+/* Implements resize_io.get_in_row for img->stream. */
+static const unsigned char *image_stream_get_in_row(const struct resize_io *io, unsigned y) {
+	struct image_stream *s = (struct image_stream*)io->ctx;
+	if (y >= io->output_height) y = io->output_height - 1;
+	while (s->rows_read <= y) image_stream_read_row(s);
+	return s->rows[y % s->nrows];
+}
+
+static unsigned char *image_stream_get_out_row(const struct resize_io *io, unsigned y) {
+	struct image_stream *s = (struct image_stream*)io->ctx;
+	return s->out_rows[y % s->out_nrows];
+}
+
+/* Writes the resized rows in batches of out_nrows. */
+static void image_stream_put_out_row(const struct resize_io *io, unsigned y) {
+	struct image_stream *s = (struct image_stream*)io->ctx;
+	if ((y + 1) % s->out_nrows == 0 || y + 1 == io->out_height) {
+		jpeg_write_scanlines(s->cinfo, s->out_rows, y % s->out_nrows + 1);
+	}
+}
+
+/*
+ * Reads the remaining scanlines of img->stream, and frees it.
+ * Returns 0 on a fatal decoding error.
+ */
+static char image_stream_finish(struct image *img) {
+	struct image_stream *s = img->stream;
+	char result;
+
+	s->finish(s);
+	close_input_file(&s->input);
+	result = !s->has_error;
+	if (!result) add_exit_code(4);
+	free(s);
+	img->stream = NULL;
+	return result;
+}
+
+/*
+ * Reads the scanlines of img->stream, resizes them and writes them to
+ * cinfo, keeping only a few rows in memory. Frees img->stream.
+ * Returns 0 on a fatal decoding error.
+ */
+static char write_image_stream(struct image *img, j_compress_ptr cinfo) {
+	struct image_stream *s = img->stream;
+	struct resize_io io;
+	unsigned y, n;
+
+	init_resize_io(&io, img);
+	io.get_in_row = image_stream_get_in_row;
+	io.get_out_row = image_stream_get_out_row;
+	io.put_out_row = image_stream_put_out_row;
+	io.in_data = NULL;
+	io.ctx = s;
+	s->cinfo = cinfo;
+	if (needs_resize(img)) {
+		/* An iMCU row of the compressor: jpeg_write_scanlines processes it at once. */
+		s->out_nrows = cinfo->max_v_samp_factor * DCTSIZE;
+		s->out_rows = (*cinfo->mem->alloc_sarray)
+		    ((j_common_ptr)cinfo, JPOOL_IMAGE, img->scalewidth * img->num_components, s->out_nrows);
+		get_resize_func()(&io, 0, img->scaleheight);
+	} else {
+		/* Write the decoded rows directly from the ring buffer. */
+		for (y = 0; y < img->scaleheight; y += n) {
+			(void)image_stream_get_in_row(&io, y);
+			n = s->rows_read - y;
+			if (n > s->nrows - y % s->nrows) n = s->nrows - y % s->nrows;
+			if (n > img->scaleheight - y) n = img->scaleheight - y;
+			jpeg_write_scanlines(cinfo, s->rows + y % s->nrows, n);
+		}
+	}
+	return image_stream_finish(img);
+}
+
+/* Compresses the planes set by set_raw_planes, an iMCU row at a time. */
+static void write_raw_planes(j_compress_ptr cinfo, const struct plane *planes) {
+	JSAMPROW rows[3][RAW_MAX_SAMP_FACTOR * DCTSIZE];
+	JSAMPARRAY bufs[3];
+	unsigned c, i, n, y;
+
+	for (y = 0; cinfo->next_scanline < cinfo->image_height; ++y) {
+		for (c = 0; c < 3; ++c) {
+			n = raw_samp_factors[c] * DCTSIZE;
+			for (i = 0; i < n; ++i) rows[c][i] = planes[c].data + (size_t)(y * n + i) * planes[c].stride;
+			bufs[c] = rows[c];
+		}
+		jpeg_write_raw_data(cinfo, bufs, RAW_MAX_SAMP_FACTOR * DCTSIZE);
+	}
+}
+
+/* Starts compressing img at quality, and writes the REALDIMEN comment. */
+static void start_thumbnail_compress(j_compress_ptr cinfo, const struct image *img, int quality) {
+	char comment_text[16 + sizeof(unsigned) * 6];
+	jpeg_set_quality(cinfo, quality, TRUE);  /* Baseline: 8-bit quantization tables even at low qualities. */
+	jpeg_start_compress(cinfo, FALSE);
+	sprintf(comment_text, "REALDIMEN:%ux%u",
+	        img->width, img->height);
+	jpeg_write_marker(cinfo, JPEG_COM, (void*)comment_text,
+	                  strlen(comment_text));
+}
+
+/* Compresses the planes of img, or the pixels in o, which are kept. */
+static void write_thumbnail_rows(j_compress_ptr cinfo, const struct image *img, unsigned char *o) {
+	JSAMPARRAY rows;
+	unsigned y, row_width;
+
+	if (img->is_raw) {
+		write_raw_planes(cinfo, img->planes);
+		return;
+	}
+	row_width = cinfo->input_components * cinfo->image_width;
+	rows = (JSAMPARRAY)(*cinfo->mem->alloc_small)
+	    ((j_common_ptr)cinfo, JPOOL_IMAGE, cinfo->image_height * sizeof(JSAMPROW));
+	for (y = 0; y < cinfo->image_height; ++y) rows[y] = o + y * row_width;
+	while (cinfo->next_scanline < cinfo->image_height) {
+		jpeg_write_scanlines(cinfo, rows + cinfo->next_scanline,
+		                     cinfo->image_height - cinfo->next_scanline);
+	}
+}
+
+/*
+ * Compresses img to memory for --max-bytes, binary searching for the
+ * highest quality (up to -q) which fits, in at most MAX_QUALITY_ATTEMPTS
+ * attempts. Each attempt compresses the same resized pixels again.
+ * Returns the malloc()ed JPEG data of the highest quality which fits, or
+ * of the smallest result if none fits.
+ */
+static unsigned char *compress_to_max_bytes(j_compress_ptr cinfo, const struct image *img, unsigned char *o, const char *filename, unsigned long *size_out) {
+	unsigned char *best = NULL, *buf;
+	unsigned long best_size = 0, size;
+	char best_fits = 0, fits;
+	int lo = 1, hi = g_flags.quality, quality;
+	unsigned attempt;
+
+	for (attempt = 0; attempt < MAX_QUALITY_ATTEMPTS && lo <= hi; ++attempt) {
+		/* Try -q first, it fits most of the time. */
+		quality = attempt == 0 ? hi : (lo + hi) >> 1;
+		buf = NULL;
+		size = 0;
+		jpeg_mem_dest(cinfo, &buf, &size);
+		start_thumbnail_compress(cinfo, img, quality);
+		write_thumbnail_rows(cinfo, img, o);
+		jpeg_finish_compress(cinfo);
+		fits = size <= (unsigned long)g_flags.max_bytes;
+		if (fits) {
+			lo = quality + 1;
+		} else {
+			hi = quality - 1;
+		}
+		if (!best || fits || (!best_fits && size < best_size)) {
+			free(best);
+			best = buf;
+			best_size = size;
+			best_fits = fits;
+		} else {
+			free(buf);
+		}
+	}
+	if (!best_fits) {
+		fprintf(stderr, "%s: thumbnail doesn't fit in %ld bytes, writing %lu bytes: %s\n",
+		    g_flags.progname, g_flags.max_bytes, best_size, filename);
+	}
+	*size_out = best_size;
+	return best;
+}
+
+/* Writes data[:size] to fd, normally with a single write(). Returns 0 on error. */
+static char write_all(int fd, const unsigned char *data, size_t size) {
+	ssize_t got;
+	while (size > 0) {
+		if ((got = write(fd, data, size)) < 0) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		data += got;
+		size -= got;
+	}
+	return 1;
+}
+
+/*
+ * Compresses size->img.data (or the resized size->img.stream) to the tmp
+ * file, and renames it to the final thumbnail filename. Frees
+ * size->img.data and size->img.stream. Returns whether it has succeeded.
+ */
+static char encode_thumbnail_size(struct thumbnail_size *size) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr cerr;
+	struct image *img = &size->img;
+	unsigned char *o = img->data;
+	unsigned char *jpeg_data = NULL;
+	unsigned long jpeg_size;
+	unsigned c;
+	char is_ok = 1, is_written = 1;
+
+	img->data = NULL;  /* Extra carefulness to prevent a double free. */
+	stats_start(&img->stats);
+
+	/* Prepare the compression object. */
+	cinfo.err = jpeg_std_error(&cerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.image_width = img->scalewidth;
+	cinfo.image_height = img->scaleheight;
+	cinfo.input_components = img->num_components;
+	cinfo.in_color_space = img->colorspace;
+	jpeg_set_defaults(&cinfo);
+	if (img->is_raw) {
+		cinfo.raw_data_in = TRUE;
+		for (c = 0; c < 3; ++c) {
+			cinfo.comp_info[c].h_samp_factor = cinfo.comp_info[c].v_samp_factor = raw_samp_factors[c];
+		}
+	}
+
+	/* Write the image out. */
+	if (g_flags.max_bytes) {
+		jpeg_data = compress_to_max_bytes(&cinfo, img, o, size->final, &jpeg_size);
+		stats_stop(&img->stats, ST_ENCODE);
+		is_written = write_all(fileno(img->outfile), jpeg_data, jpeg_size);
+		free(jpeg_data);
+	} else {
+		jpeg_stdio_dest(&cinfo, img->outfile);
+		start_thumbnail_compress(&cinfo, img, g_flags.quality);
+		if (img->stream) {
+			is_ok = write_image_stream(img, &cinfo);
+		} else {
+			write_thumbnail_rows(&cinfo, img, o);
+		}
+		jpeg_finish_compress(&cinfo);
+		stats_stop(&img->stats, ST_ENCODE);
+		fflush(img->outfile);
+	}
+	if (!is_ok || !is_written || ferror(img->outfile)) {
+		if (is_ok) {
+			fprintf(stderr, "%s: error writing data to: %s\n", g_flags.progname, size->tmp_filename);
+			add_exit_code(2);
+		}
+		fclose(img->outfile);
+		img->outfile = NULL;
+		jpeg_destroy_compress(&cinfo);
+		free(o);
+		unlink(size->tmp_filename);
+		return 0;
+	}
+	fclose(img->outfile);
+	img->outfile = NULL;
+	jpeg_destroy_compress(&cinfo);
+	free(o);
+
+	if (rename(size->tmp_filename, size->final)) {
+		fprintf(stderr, "%s: can't rename(%s, %s): "
+		    "%s\n", g_flags.progname, size->tmp_filename, size->final,
+		    strerror(errno));
+		unlink(size->tmp_filename);
+		add_exit_code(2);
+		return 0;
+	}
+	stats_stop(&img->stats, ST_WRITE);
+	return 1;
+}
+
+/*
+ * Stage 3 of creating a thumbnail: compresses and writes each size. The
+ * timings of all sizes are recorded together, as those of the image.
+ */
+static void thumbnail_encode(struct thumbnail *th) {
+	struct image_stats *st = &th->sizes[0].img.stats;
+	const struct image_stats *size_st;
+	unsigned i, stage;
+	char is_ok = 1;
+
+	for (i = 0; i < th->nsizes; ++i) {
+		if (!encode_thumbnail_size(th->sizes + i)) is_ok = 0;
+		if (i == 0) continue;
+		size_st = &th->sizes[i].img.stats;
+		for (stage = 0; stage < ST_COUNT; ++stage) {
+			st->wall[stage] += size_st->wall[stage];
+			st->cpu[stage] += size_st->cpu[stage];
+		}
+	}
+	if (!is_ok) return;
+	if (g_flags.stats && g_flags.draft) check_alloc(st->filename = strdup(th->filename));
+	stats_add(st);
+}
+
+static void create_thumbnail(struct input_entry *entry) {
+	struct thumbnail ths, *th = &ths;
+
+	th->entry = entry;
+	th->filename = entry->filename;
+	if (!thumbnail_decode(th)) return;
+	thumbnail_resize(th);
+	thumbnail_encode(th);
+}
+
+/* --- Pipelined mode (-P) */
+
+/* Bounded blocking FIFO queue of pointers. */
+struct queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty, not_full;
+	void **items;
+	unsigned capacity, first, count;
+};
+
+static void queue_init(struct queue *q, unsigned capacity) {
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	check_alloc(q->items = malloc(capacity * sizeof(*q->items)));
+	q->capacity = capacity;
+	q->first = q->count = 0;
+}
+
+/* Appends item to q. Blocks while q is full: this is the backpressure. */
+static void queue_push(struct queue *q, void *item) {
+	pthread_mutex_lock(&q->mutex);
+	while (q->count == q->capacity)
+		pthread_cond_wait(&q->not_full, &q->mutex);
+	q->items[(q->first + q->count++) % q->capacity] = item;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* Removes and returns the first item of q. Blocks while q is empty. */
+static void *queue_pop(struct queue *q) {
+	void *item;
+	pthread_mutex_lock(&q->mutex);
+	while (q->count == 0)
+		pthread_cond_wait(&q->not_empty, &q->mutex);
+	item = q->items[q->first];
+	q->first = (q->first + 1) % q->capacity;
+	--q->count;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->mutex);
+	return item;
+}
+
+/*
+ * With -P, each stage of create_thumbnail has its own threads, connected
+ * by bounded queues, so that reading, decoding, resizing, encoding and
+ * writing of different images overlap. The number of images in memory is
+ * at most 5 times -j.
+ */
+static struct {
+	struct queue decode_q, resize_q, encode_q;
+} g_pipeline;
+
+static void thumbnail_done(struct thumbnail *th) {
+	task_group_done(th->group);
+	free(th);
+}
+
+static void *pipeline_decode_thread(void *arg) {
+	struct thumbnail *th;
+	(void)arg;
+	for (;;) {
+		th = (struct thumbnail*)queue_pop(&g_pipeline.decode_q);
+		if (thumbnail_decode(th)) {
+			queue_push(&g_pipeline.resize_q, th);
+		} else {
+			thumbnail_done(th);
+		}
+	}
+	return NULL;  /* Not reached. */
+}
+
+static void *pipeline_resize_thread(void *arg) {
+	struct thumbnail *th;
+	(void)arg;
+	for (;;) {
+		th = (struct thumbnail*)queue_pop(&g_pipeline.resize_q);
+		thumbnail_resize(th);
+		queue_push(&g_pipeline.encode_q, th);
+	}
+	return NULL;  /* Not reached. */
+}
+
+static void *pipeline_encode_thread(void *arg) {
+	struct thumbnail *th;
+	(void)arg;
+	for (;;) {
+		th = (struct thumbnail*)queue_pop(&g_pipeline.encode_q);
+		thumbnail_encode(th);
+		thumbnail_done(th);
+	}
+	return NULL;  /* Not reached. */
+}
+
+/* Starts nthreads threads for each stage. Returns 0 on failure. */
+static char pipeline_init(unsigned nthreads) {
+	static void *(*const stage_funcs[3])(void*) = {
+	    pipeline_decode_thread, pipeline_resize_thread, pipeline_encode_thread };
+	pthread_t thread;
+	unsigned i, j;
+	int err;
+	queue_init(&g_pipeline.decode_q, nthreads);
+	queue_init(&g_pipeline.resize_q, nthreads);
+	queue_init(&g_pipeline.encode_q, nthreads);
+	for (i = 0; i < nthreads; ++i) {
+		for (j = 0; j < 3; ++j) {
+			if ((err = pthread_create(&thread, NULL, stage_funcs[j], NULL)) != 0) {
+				fprintf(stderr, "%s: can't create thread: %s\n", g_flags.progname, strerror(err));
+				if (i == 0) return 0;  /* A stage may have no threads. */
+				return 1;
+			}
+			pthread_detach(thread);
+		}
+	}
+	return 1;
+}
+
+/* Queues entry for creating its thumbnail in the pipeline. */
+static void pipeline_submit(struct task_group *group, struct input_entry *entry) {
+	struct thumbnail *th;
+	check_alloc(th = malloc(sizeof(*th)));
+	th->entry = entry;
+	th->filename = entry->filename;
+	th->group = group;
+	task_group_add(group);
+	queue_push(&g_pipeline.decode_q, th);
+}
+
+struct thumbnail_job {
+	struct input_entry *entry;
+	char *final;  /* Thumbnail filename, used only for finding conflicts. */
+	unsigned index;
+	char is_head;  /* Is it the first job in its next_same chain? */
+	struct thumbnail_job *next_same;  /* Next job writing the same thumbnail file. */
+	struct dir_node *node;  /* Used by process_dir_tree only. */
+};
+
+static int sort_jobs_by_final(const void *a, const void *b) {
+	const struct thumbnail_job *ja = *(struct thumbnail_job**)a;
+	const struct thumbnail_job *jb = *(struct thumbnail_job**)b;
+	const int c = strcmp(ja->final, jb->final);
+	return c != 0 ? c : ja->index < jb->index ? -1 : ja->index > jb->index;
+}
+
+static void run_thumbnail_job(void *arg) {
+	struct thumbnail_job *job;
+	for (job = (struct thumbnail_job*)arg; job; job = job->next_same) {
+		create_thumbnail(job->entry);
+	}
+}
+
+/*
+ * Returns a malloc()ed array of jobs for files[:count]. If anything
+ * runs in parallel, inputs which would write the same thumbnail file (e.g.
+ * a.jpg and a.png) are chained, to be processed sequentially in input
+ * order, so that the last one wins, just like without -j.
+ */
+static struct thumbnail_job *make_thumbnail_jobs(struct input_entry *files, unsigned count) {
+	struct thumbnail_job *jobs, **byname;
+	unsigned i;
+
+	check_alloc(jobs = malloc((count + (count == 0)) * sizeof(*jobs)));
+	for (i = 0; i < count; ++i) {
+		jobs[i].entry = files + i;
+		jobs[i].index = i;
+		jobs[i].is_head = 1;
+		jobs[i].next_same = NULL;
+		jobs[i].node = NULL;
+	}
+	if (g_pool.nthreads > 0 || g_flags.pipeline) {  /* Chain the jobs with the same thumbnail filename. */
+		check_alloc(byname = malloc(count * sizeof(*byname)));
+		for (i = 0; i < count; ++i) {
+			/* All sizes of -H conflict alike, so the first one is enough. */
+			check_alloc(jobs[i].final = malloc(strlen(files[i].filename) + THUMBNAIL_SUFFIX_SIZE));
+			if (!get_thumbnail_filename(files[i].filename, 0, jobs[i].final))
+				strcpy(jobs[i].final, files[i].filename);
+			byname[i] = jobs + i;
+		}
+		qsort(byname, count, sizeof(*byname), sort_jobs_by_final);
+		for (i = 1; i < count; ++i) {
+			if (0 == strcmp(byname[i - 1]->final, byname[i]->final)) {
+				byname[i - 1]->next_same = byname[i];
+				byname[i]->is_head = 0;
+			}
+		}
+		for (i = 0; i < count; ++i) {
+			free(jobs[i].final);
+		}
+		free(byname);
+	}
+	return jobs;
+}
+
+/*
+ * Creates the thumbnails for files[:count], in parallel if -j is
+ * larger than 1, and waits for them. The "Image" log lines are printed in
+ * input order.
+ */
+static void process_files(struct input_entry *files, unsigned count) {
+	struct thumbnail_job *jobs, **wave;
+	struct task_group group;
+	unsigned i, n;
+
+	if (count == 0) return;
+	jobs = make_thumbnail_jobs(files, count);
+	group.pending = 0;
+	for (i = 0; i < count; ++i) {
+		printf("Image %s\n", files[i].filename);
+		fflush(stdout);
+		if (!jobs[i].is_head) {
+		} else if (g_flags.pipeline) {
+			pipeline_submit(&group, files + i);
+		} else {
+			pool_submit(&group, run_thumbnail_job, jobs + i);
+		}
+	}
+	pool_wait(&group);
+	if (g_flags.pipeline) {
+		/* The pipeline processes chained jobs in waves: the next job of a
+		 * chain is submitted only after the previous one has been written.
+		 */
+		check_alloc(wave = malloc(count * sizeof(*wave)));
+		for (;;) {
+			n = 0;
+			for (i = 0; i < count; ++i) {
+				if (jobs[i].is_head && jobs[i].next_same) wave[n++] = jobs[i].next_same;
+				jobs[i].is_head = 0;
+			}
+			if (n == 0) break;
+			for (i = 0; i < n; ++i) {
+				wave[i]->is_head = 1;
+				pipeline_submit(&group, wave[i]->entry);
+			}
+			pool_wait(&group);
+		}
+		free(wave);
+	}
+	free(jobs);
+}
+
+/* --- Parallel directory walk */
+
+/*
+ * With worker threads, process_dir_tree scans directories and creates
+ * thumbnails as pool tasks: subdirectories are scanned in parallel with
+ * their siblings and with the images of their parent. The stdout lines
+ * of each directory are collected in its dir_node, and they are printed
+ * in the same order (pre-order of sorted directories) as without -j.
+ */
+
+struct dir_walk {
+	pthread_mutex_t mutex;  /* Protects cursor and dir_node.pending and is_done. */
+	struct dir_node *cursor;  /* Next node to print, or NULL when done. */
+	struct task_group group;
+};
+
+struct dir_node {
+	struct dir_walk *walk;
+	char *dir;
+	struct dir_node *parent;
+	unsigned child_index;  /* Index in parent->children. */
+	struct dir_node **children;
+	unsigned nchildren;
+	struct input_entry *imglist;
+	unsigned imgcount;
+	struct thumbnail_job *jobs;
+	unsigned pending;  /* Number of unfinished job chains. */
+	char is_done;  /* Is log complete? */
+	char *log;  /* Lines to be printed to stdout. */
+	size_t log_size, log_capacity;
+};
+
+/* Appends a line to be printed to stdout to node->log, like printf. */
+static void dir_node_printf(struct dir_node *node, const char *fmt, ...) {
+	va_list ap;
+	int size;
+	va_start(ap, fmt);
+	size = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (node->log_size + size + 1 > node->log_capacity) {
+		node->log_capacity = node->log_size + size + 1 < 256 ? 256 : (node->log_size + size + 1) << 1;
+		check_alloc(node->log = realloc(node->log, node->log_capacity));
+	}
+	va_start(ap, fmt);
+	node->log_size += vsprintf(node->log + node->log_size, fmt, ap);
+	va_end(ap);
+}
+
+static struct dir_node *new_dir_node(struct dir_walk *walk, char *dir, struct dir_node *parent, unsigned child_index) {
+	struct dir_node *node;
+	check_alloc(node = malloc(sizeof(*node)));
+	node->walk = walk;
+	node->dir = dir;  /* Takes ownership. */
+	node->parent = parent;
+	node->child_index = child_index;
+	node->children = NULL;
+	node->nchildren = 0;
+	node->imglist = NULL;
+	node->imgcount = 0;
+	node->jobs = NULL;
+	node->pending = 0;
+	node->is_done = 0;
+	node->log = NULL;
+	node->log_size = node->log_capacity = 0;
+	return node;
+}
+
+/* Returns the node after node in pre-order, and frees the nodes whose
+ * subtree has been fully printed.
+ */
+static struct dir_node *dir_node_next(struct dir_node *node) {
+	struct dir_node *parent;
+	unsigned child_index;
+	if (node->nchildren != 0) return node->children[0];
+	for (;;) {
+		parent = node->parent;
+		child_index = node->child_index;
+		free(node->children);
+		free(node->dir);
+		free(node);
+		if (!parent) return NULL;
+		if (child_index + 1 < parent->nchildren) return parent->children[child_index + 1];
+		node = parent;
 	}
+}
 
-	/*
-	 * Check if the cached image exists and is newer than the
-	 * original.
-	 */
-	if (!g_flags.force && check_cache(final, &sb)) return;
-
-	if (!load_image(img, filename, tmp_filename)) {
-		free(img->data);
-		if (img->outfile) {
-			fclose(img->outfile);
-			unlink(tmp_filename);
+/* Marks node as done, and prints all the logs which are ready in order. */
+static void dir_node_done(struct dir_node *node) {
+	struct dir_walk *walk = node->walk;
+	pthread_mutex_lock(&walk->mutex);
+	node->is_done = 1;
+	while (walk->cursor && walk->cursor->is_done) {
+		node = walk->cursor;
+		if (node->log_size != 0) {
+			fwrite(node->log, 1, node->log_size, stdout);
+			fflush(stdout);
 		}
-		return;
+		free(node->log);
+		walk->cursor = dir_node_next(node);
 	}
+	pthread_mutex_unlock(&walk->mutex);
+}
 
-	/* Resize the image. */
-	img_datasize = img->scalewidth * img->scaleheight * img->num_components;
-#if 0
-	fprintf(stderr, "img->scalewidth=%d img->scaleheight=%d img->num_components=%d img_datasize=%d\n", img->scalewidth, img->scaleheight, img->num_components, img_datasize);
-	fprintf(stderr, "img->output_width=%d img->output_height=%d s_row_width=%d\n", img->output_width, img->output_height, img->output_width * img->num_components);
-#endif
-	/* Typically, if img->output_width == img->scalewidth, then the heights are also the same.
-	 * A notable excaption when it is +1: input JPEG 700x961, -H 480, img->scale_denom=2, img->output_width=350 img->output_height=481.
-	 */
-	if (img->output_width == img->scalewidth &&
-	    (img->output_height == img->scaleheight || img->output_height == img->scaleheight + 1)) {
-		/* No scaling needed, input (p) is already of the right size.
-		 * We ignore the last row of p in the +1 case.
-		 */
-		o = img->data;
-	} else {
-		check_alloc(o = malloc(img_datasize * sizeof(unsigned char)));
-		resize_func = g_flags.bilinear ? resize_bilinear : resize_bicubic;
-		resize_func(img->num_components, img->output_width, img->output_height, img->scalewidth, img->scaleheight, img->data, o);
-		free(img->data);
-	}
-	img->data = NULL;  /* Extra carefulness to prevent a double free. */
+/* Called when the images of node have been processed. */
+static void dir_node_images_done(struct dir_node *node) {
+	dir_node_printf(node, "%d image%s processed in dir: %s\n", node->imgcount, node->imgcount != 1 ? "s" : "", node->dir);
+	free_input_entries(node->imglist, node->imgcount);
+	free(node->jobs);
+	dir_node_done(node);
+}
 
-	/* Prepare the compression object. */
-	cinfo.err = jpeg_std_error(&cerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, img->outfile);
-	cinfo.image_width = img->scalewidth;
-	cinfo.image_height = img->scaleheight;
-	cinfo.input_components = img->num_components;
-	cinfo.in_color_space = img->colorspace;
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, 50, FALSE);  /* TODO(pts): Make quality configurable. */
+static void run_dir_thumbnail_job(void *arg) {
+	struct thumbnail_job *job = (struct thumbnail_job*)arg;
+	struct dir_node *node = job->node;
+	unsigned pending;
+	run_thumbnail_job(job);
+	pthread_mutex_lock(&node->walk->mutex);
+	pending = --node->pending;
+	pthread_mutex_unlock(&node->walk->mutex);
+	if (pending == 0) dir_node_images_done(node);
+}
 
-	/* Write the image out. */
-	jpeg_start_compress(&cinfo, FALSE);
-	{
-		char comment_text[16 + sizeof(unsigned) * 6];
-		sprintf(comment_text, "REALDIMEN:%ux%u",
-		        img->width, img->height);
-		jpeg_write_marker(&cinfo, JPEG_COM, (void*)comment_text,
-		                  strlen(comment_text));
-	}
-	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = &o[cinfo.input_components *
-		    cinfo.image_width * cinfo.next_scanline];
-		jpeg_write_scanlines(&cinfo, row_pointer, 1);
-	}
-	jpeg_finish_compress(&cinfo);
-	fflush(img->outfile);
-	if (ferror(img->outfile)) {
-		fprintf(stderr, "%s: error writing data to: %s\n", g_flags.progname, tmp_filename);
-		fclose(img->outfile);
-		jpeg_destroy_compress(&cinfo);
-		free(o);
-		unlink(tmp_filename);
-		g_flags.exit_code |= 2;
+static void run_dir_scan(void *arg) {
+	struct dir_node *node = (struct dir_node*)arg;
+	char **subdirlist;
+	unsigned subdircount, i, heads, pending;
+
+	if (!scan_dir(node->dir, &node->imglist, &node->imgcount, &subdirlist, &subdircount)) {
+		dir_node_done(node);
 		return;
 	}
-	fclose(img->outfile);
-	img->outfile = NULL;
-	jpeg_destroy_compress(&cinfo);
-	free(o);
-
-	if (rename(tmp_filename, final)) {
-		fprintf(stderr, "%s: can't rename(%s, %s): "
-		    "%s\n", g_flags.progname, tmp_filename, final,
-		    strerror(errno));
-		unlink(tmp_filename);
-		g_flags.exit_code |= 2;
+	if (subdircount != 0) {
+		check_alloc(node->children = malloc(subdircount * sizeof(*node->children)));
+		for (i = 0; i < subdircount; ++i) {
+			node->children[i] = new_dir_node(node->walk, subdirlist[i], node, i);
+		}
+		node->nchildren = subdircount;
+		for (i = 0; i < subdircount; ++i) {
+			pool_submit(&node->walk->group, run_dir_scan, node->children[i]);
+		}
+	}
+	free(subdirlist);
+	node->jobs = make_thumbnail_jobs(node->imglist, node->imgcount);
+	for (i = heads = 0; i < node->imgcount; ++i) {
+		dir_node_printf(node, "Image %s\n", node->imglist[i].filename);
+		node->jobs[i].node = node;
+		heads += node->jobs[i].is_head;
+	}
+	if (heads == 0) {
+		dir_node_images_done(node);
 		return;
 	}
+	/* Before the first pool_submit. The extra 1 keeps node alive while
+	 * submitting: the jobs may finish (and free it) before the loop does.
+	 */
+	node->pending = heads + 1;
+	for (i = 0; i < node->imgcount; ++i) {
+		if (node->jobs[i].is_head) pool_submit(&node->walk->group, run_dir_thumbnail_job, node->jobs + i);
+	}
+	pthread_mutex_lock(&node->walk->mutex);
+	pending = --node->pending;
+	pthread_mutex_unlock(&node->walk->mutex);
+	if (pending == 0) dir_node_images_done(node);
+}
+
+static void process_dir_tree(char *dir) {
+	struct dir_walk walk;
+	char *root_dir;
+	check_alloc(root_dir = malloc(strlen(dir) + 1));
+	strcpy(root_dir, dir);
+	pthread_mutex_init(&walk.mutex, NULL);
+	walk.group.pending = 0;
+	walk.cursor = new_dir_node(&walk, root_dir, NULL, 0);
+	pool_submit(&walk.group, run_dir_scan, walk.cursor);
+	pool_wait(&walk.group);
+	pthread_mutex_destroy(&walk.mutex);
 }
 
 static int
@@ -1206,43 +4142,424 @@ usage(void)
 	fprintf(stderr, "   -R         process directories recursively\n");
 	fprintf(stderr, "   -r <y> ... rows per thumbnail index page\n");
 	fprintf(stderr, "   -H <j> ... height of the scaled images in pixel "
-	    "(default: %d)\n", g_flags.scaleheight);
+	    "(default: %d)\n", g_flags.scaleheights[0]);
+	fprintf(stderr, "              or a comma-separated list of up to %d heights, "
+	    "e.g. 1080,480,160:\n", MAX_THUMBNAIL_SIZES);
+	fprintf(stderr, "              decodes once, writes *.th<height>.jpg\n");
+	fprintf(stderr, "   -j <n> ... number of images processed in parallel "
+	    "(default: number of CPUs)\n");
+	fprintf(stderr, "   -P     ... pipeline: decode, resize and encode in "
+	    "separate threads,\n");
+	fprintf(stderr, "              -j threads each\n");
+	fprintf(stderr, "   -S     ... stream: resize JPEG and non-interlaced PNG scanlines\n");
+	fprintf(stderr, "              while decoding, using less memory (ignored with -P,\n");
+	fprintf(stderr, "              --max-bytes and multiple -H heights)\n");
 	fprintf(stderr, "   -f     ... force rebuild of everything; ignore "
 	    "cache\n");
 	fprintf(stderr, "   -l     ... use bilinear resizing instead of "
 	    "bicubic\n");
 	fprintf(stderr, "              (faster, but image quality is poor)\n");
+	fprintf(stderr, "   -k <f> ... resampling filter: box, triangle, catmull-rom, "
+	    "lanczos3\n");
+	fprintf(stderr, "              (default: box)\n");
+	fprintf(stderr, "   -F     ... resize with floating point (slower, rounds "
+	    "down; box only)\n");
 	fprintf(stderr, "              ('name', 'size', 'mtime'; default is "
 	    "'name')\n");
 	fprintf(stderr, "   -a     ... also create thumbnails for small files (no scaling)\n");
+	fprintf(stderr, "   -q <q> ... JPEG quality of the thumbnails, 1..100 "
+	    "(default: %d)\n", g_flags.quality);
+	fprintf(stderr, "   --max-bytes <n>  lower the quality (below -q) until the "
+	    "thumbnail fits\n");
+	fprintf(stderr, "              in <n> bytes, trying at most %d qualities\n",
+	    MAX_QUALITY_ATTEMPTS);
+	fprintf(stderr, "   --stats    print per-stage timings, latency percentiles "
+	    "and throughput\n");
+	fprintf(stderr, "              by input format at exit\n");
+	fprintf(stderr, "   --draft    fast, lower quality JPEG decoding; snaps -H to "
+	    "the nearest\n");
+	fprintf(stderr, "              DCT scale if within %d%%, without resizing; "
+	    "with --stats,\n", DRAFT_MAX_DEVIATION_PERCENT);
+	fprintf(stderr, "              also prints the decode time of the default "
+	    "profile per image\n");
+	fprintf(stderr, "   --no-embedded  always decode the main JPEG image, not an "
+	    "EXIF thumbnail\n");
+	fprintf(stderr, "              or MPF preview which is at least -H high\n");
+	fprintf(stderr, "   --partial-progressive  when downscaling a progressive "
+	    "JPEG, decode only\n");
+	fprintf(stderr, "              the first scans of the DCT coefficients "
+	    "used at that scale\n");
+	fprintf(stderr, "   --no-raw   convert JPEG images to RGB and back, rather "
+	    "than resizing\n");
+	fprintf(stderr, "              the Y, Cb and Cr planes separately (not with "
+	    "-S)\n");
+	fprintf(stderr, "   --no-sniff in directories, don't read the header of "
+	    "regular files with\n");
+	fprintf(stderr, "              a .jpg, .jpeg, .png or .gif extension to "
+	    "check that they are\n");
+	fprintf(stderr, "              images\n");
+	fprintf(stderr, "   --full-interlaced  decode all Adam7 passes of interlaced PNGs, "
+	    "rather\n");
+	fprintf(stderr, "              than only the first ones which contain every "
+	    "2nd, 4th or\n");
+	fprintf(stderr, "              8th pixel, if that's still twice as large as "
+	    "the thumbnail\n");
+	fprintf(stderr, "   --detect-gray  make grayscale thumbnails of RGB PNG "
+	    "and GIF images if all\n");
+	fprintf(stderr, "              their pixels are gray (not with -S)\n");
 	fprintf(stderr, "   -v     ... show version info\n\n");
 }
 
+/* --- Row operations of the resize functions, vectorized if possible */
+
+/*
+ * The vectorized implementations do the same double precision operations
+ * (without fused multiply-add) as the scalar ones, so the output is
+ * bitwise identical. Input values are between 0 and 255, and
+ * the weights add up to 1, so truncating conversion to bytes with
+ * saturation is the same as the (unsigned char) cast.
+ */
+struct resize_ops {
+	const char *name;
+	/* y[i] = w * x[i] for i < n. */
+	void (*mul_row)(double *y, const unsigned char *x, double w, unsigned n);
+	/* y[i] += w * x[i] for i < n. */
+	void (*mul_add_row)(double *y, const unsigned char *x, double w, unsigned n);
+	/* o[i] = (unsigned char)t[i] for i < n. */
+	void (*to_bytes)(unsigned char *o, const double *t, unsigned n);
+	/* o[i] = omy * (omx[i] * f[fi[i]] + fx[i] * f[ci[i]]) +
+	 *        fy * (omx[i] * c[fi[i]] + fx[i] * c[ci[i]]) for i < n.
+	 */
+	void (*bilinear_row)(unsigned char *o, const unsigned char *f, const unsigned char *c,
+	                     const unsigned *fi, const unsigned *ci, const double *fx, const double *omx,
+	                     double fy, double omy, unsigned n);
+	/* Integer versions of mul_row and mul_add_row, for -32768 < w < 32768. */
+	void (*imul_row)(int *y, const unsigned char *x, int w, unsigned n);
+	void (*imul_add_row)(int *y, const unsigned char *x, int w, unsigned n);
+};
+
+static void mul_row_scalar(double *y, const unsigned char *x, double w, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++)
+		y[i] = w * (double)x[i];
+}
+
+static void mul_add_row_scalar(double *y, const unsigned char *x, double w, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++)
+		y[i] += w * (double)x[i];
+}
+
+static void to_bytes_scalar(unsigned char *o, const double *t, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++)
+		o[i] = (unsigned char)t[i];
+}
+
+static void bilinear_row_scalar(unsigned char *o, const unsigned char *f, const unsigned char *c,
+                                const unsigned *fi, const unsigned *ci, const double *fx, const double *omx,
+                                double fy, double omy, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		o[i] = omy *
+		    (omx[i] * f[fi[i]] +
+		    fx[i] * f[ci[i]]) +
+		    fy * (omx[i] * c[fi[i]] +
+		    fx[i]  * c[ci[i]]);
+	}
+}
+
+static void imul_row_scalar(int *y, const unsigned char *x, int w, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++)
+		y[i] = w * x[i];
+}
+
+static void imul_add_row_scalar(int *y, const unsigned char *x, int w, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n; i++)
+		y[i] += w * x[i];
+}
+
+static const struct resize_ops resize_ops_scalar = {
+	"scalar", mul_row_scalar, mul_add_row_scalar, to_bytes_scalar, bilinear_row_scalar,
+	imul_row_scalar, imul_add_row_scalar,
+};
+
+/* Used by the resize functions. Set by select_resize_ops. */
+static const struct resize_ops *g_resize_ops = &resize_ops_scalar;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#define USE_X86_SIMD 1
+#endif
+
+#ifdef USE_X86_SIMD
+#include <immintrin.h>
+
+/* Converts x[0..3] to 4 int32s. */
+__attribute__((target("sse2")))
+static __m128i load4_epu8_sse2(const unsigned char *x) {
+	int v;
+	memcpy(&v, x, 4);
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), _mm_setzero_si128()), _mm_setzero_si128());
+}
+
+__attribute__((target("sse2")))
+static void mul_row_sse2(double *y, const unsigned char *x, double w, unsigned n) {
+	const __m128d wv = _mm_set1_pd(w);
+	unsigned i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		const __m128i v = load4_epu8_sse2(x + i);
+		_mm_storeu_pd(y + i, _mm_mul_pd(wv, _mm_cvtepi32_pd(v)));
+		_mm_storeu_pd(y + i + 2, _mm_mul_pd(wv, _mm_cvtepi32_pd(_mm_srli_si128(v, 8))));
+	}
+	mul_row_scalar(y + i, x + i, w, n - i);
+}
+
+__attribute__((target("sse2")))
+static void mul_add_row_sse2(double *y, const unsigned char *x, double w, unsigned n) {
+	const __m128d wv = _mm_set1_pd(w);
+	unsigned i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		const __m128i v = load4_epu8_sse2(x + i);
+		_mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(wv, _mm_cvtepi32_pd(v))));
+		_mm_storeu_pd(y + i + 2, _mm_add_pd(_mm_loadu_pd(y + i + 2), _mm_mul_pd(wv, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)))));
+	}
+	mul_add_row_scalar(y + i, x + i, w, n - i);
+}
+
+/* Truncates 4 doubles (between 0 and 255) to 4 bytes. */
+__attribute__((target("sse2")))
+static void store4_bytes_sse2(unsigned char *o, __m128d lo, __m128d hi) {
+	__m128i v = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+	int r;
+	v = _mm_packs_epi32(v, v);
+	r = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+	memcpy(o, &r, 4);
+}
+
+__attribute__((target("sse2")))
+static void to_bytes_sse2(unsigned char *o, const double *t, unsigned n) {
+	unsigned i;
+	for (i = 0; i + 4 <= n; i += 4)
+		store4_bytes_sse2(o + i, _mm_loadu_pd(t + i), _mm_loadu_pd(t + i + 2));
+	to_bytes_scalar(o + i, t + i, n - i);
+}
+
+/* Returns p[idx[0]], p[idx[1]] as doubles. */
+__attribute__((target("sse2")))
+static __m128d gather2_sse2(const unsigned char *p, const unsigned *idx) {
+	return _mm_cvtepi32_pd(_mm_set_epi32(0, 0, p[idx[1]], p[idx[0]]));
+}
+
+__attribute__((target("sse2")))
+static void bilinear_row_sse2(unsigned char *o, const unsigned char *f, const unsigned char *c,
+                              const unsigned *fi, const unsigned *ci, const double *fx, const double *omx,
+                              double fy, double omy, unsigned n) {
+	const __m128d fyv = _mm_set1_pd(fy), omyv = _mm_set1_pd(omy);
+	__m128d r[2];
+	unsigned i, j;
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (j = 0; j < 2; ++j) {
+			const unsigned k = i + 2 * j;
+			const __m128d fxv = _mm_loadu_pd(fx + k), omxv = _mm_loadu_pd(omx + k);
+			r[j] = _mm_add_pd(
+			    _mm_mul_pd(omyv, _mm_add_pd(_mm_mul_pd(omxv, gather2_sse2(f, fi + k)),
+			                                _mm_mul_pd(fxv, gather2_sse2(f, ci + k)))),
+			    _mm_mul_pd(fyv, _mm_add_pd(_mm_mul_pd(omxv, gather2_sse2(c, fi + k)),
+			                               _mm_mul_pd(fxv, gather2_sse2(c, ci + k)))));
+		}
+		store4_bytes_sse2(o + i, r[0], r[1]);
+	}
+	bilinear_row_scalar(o + i, f, c, fi + i, ci + i, fx + i, omx + i, fy, omy, n - i);
+}
+
+/* Returns w * x[0..7] as 2 vectors of 4 int32s. wv has (w, 0) int16 pairs. */
+__attribute__((target("sse2")))
+static void imul8_sse2(const unsigned char *x, __m128i wv, __m128i *lo, __m128i *hi) {
+	const __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)x), _mm_setzero_si128());
+	*lo = _mm_madd_epi16(_mm_unpacklo_epi16(v, _mm_setzero_si128()), wv);
+	*hi = _mm_madd_epi16(_mm_unpackhi_epi16(v, _mm_setzero_si128()), wv);
+}
+
+__attribute__((target("sse2")))
+static void imul_row_sse2(int *y, const unsigned char *x, int w, unsigned n) {
+	const __m128i wv = _mm_set1_epi32(w & 0xffff);
+	__m128i lo, hi;
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		imul8_sse2(x + i, wv, &lo, &hi);
+		_mm_storeu_si128((__m128i*)(y + i), lo);
+		_mm_storeu_si128((__m128i*)(y + i + 4), hi);
+	}
+	imul_row_scalar(y + i, x + i, w, n - i);
+}
+
+__attribute__((target("sse2")))
+static void imul_add_row_sse2(int *y, const unsigned char *x, int w, unsigned n) {
+	const __m128i wv = _mm_set1_epi32(w & 0xffff);
+	__m128i lo, hi;
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		imul8_sse2(x + i, wv, &lo, &hi);
+		_mm_storeu_si128((__m128i*)(y + i), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(y + i)), lo));
+		_mm_storeu_si128((__m128i*)(y + i + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(y + i + 4)), hi));
+	}
+	imul_add_row_scalar(y + i, x + i, w, n - i);
+}
+
+static const struct resize_ops resize_ops_sse2 = {
+	"sse2", mul_row_sse2, mul_add_row_sse2, to_bytes_sse2, bilinear_row_sse2,
+	imul_row_sse2, imul_add_row_sse2,
+};
+
+/* Converts x[0..7] to 8 doubles. */
+__attribute__((target("avx2")))
+static void load8_epu8_avx2(const unsigned char *x, __m256d *lo, __m256d *hi) {
+	const __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)x));
+	*lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+	*hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static void mul_row_avx2(double *y, const unsigned char *x, double w, unsigned n) {
+	const __m256d wv = _mm256_set1_pd(w);
+	__m256d lo, hi;
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		load8_epu8_avx2(x + i, &lo, &hi);
+		_mm256_storeu_pd(y + i, _mm256_mul_pd(wv, lo));
+		_mm256_storeu_pd(y + i + 4, _mm256_mul_pd(wv, hi));
+	}
+	mul_row_scalar(y + i, x + i, w, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_row_avx2(double *y, const unsigned char *x, double w, unsigned n) {
+	const __m256d wv = _mm256_set1_pd(w);
+	__m256d lo, hi;
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		load8_epu8_avx2(x + i, &lo, &hi);
+		_mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(wv, lo)));
+		_mm256_storeu_pd(y + i + 4, _mm256_add_pd(_mm256_loadu_pd(y + i + 4), _mm256_mul_pd(wv, hi)));
+	}
+	mul_add_row_scalar(y + i, x + i, w, n - i);
+}
+
+/* Truncates 8 doubles (between 0 and 255) to 8 bytes. */
+__attribute__((target("avx2")))
+static void store8_bytes_avx2(unsigned char *o, __m256d lo, __m256d hi) {
+	__m128i v = _mm_packs_epi32(_mm256_cvttpd_epi32(lo), _mm256_cvttpd_epi32(hi));
+	_mm_storel_epi64((__m128i*)o, _mm_packus_epi16(v, v));
+}
+
+__attribute__((target("avx2")))
+static void to_bytes_avx2(unsigned char *o, const double *t, unsigned n) {
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8)
+		store8_bytes_avx2(o + i, _mm256_loadu_pd(t + i), _mm256_loadu_pd(t + i + 4));
+	to_bytes_scalar(o + i, t + i, n - i);
+}
+
+/* Returns p[idx[0..3]] as doubles. */
+__attribute__((target("avx2")))
+static __m256d gather4_avx2(const unsigned char *p, const unsigned *idx) {
+	return _mm256_cvtepi32_pd(_mm_set_epi32(p[idx[3]], p[idx[2]], p[idx[1]], p[idx[0]]));
+}
+
+__attribute__((target("avx2")))
+static void bilinear_row_avx2(unsigned char *o, const unsigned char *f, const unsigned char *c,
+                              const unsigned *fi, const unsigned *ci, const double *fx, const double *omx,
+                              double fy, double omy, unsigned n) {
+	const __m256d fyv = _mm256_set1_pd(fy), omyv = _mm256_set1_pd(omy);
+	__m256d r[2];
+	unsigned i, j;
+	for (i = 0; i + 8 <= n; i += 8) {
+		for (j = 0; j < 2; ++j) {
+			const unsigned k = i + 4 * j;
+			const __m256d fxv = _mm256_loadu_pd(fx + k), omxv = _mm256_loadu_pd(omx + k);
+			r[j] = _mm256_add_pd(
+			    _mm256_mul_pd(omyv, _mm256_add_pd(_mm256_mul_pd(omxv, gather4_avx2(f, fi + k)),
+			                                      _mm256_mul_pd(fxv, gather4_avx2(f, ci + k)))),
+			    _mm256_mul_pd(fyv, _mm256_add_pd(_mm256_mul_pd(omxv, gather4_avx2(c, fi + k)),
+			                                     _mm256_mul_pd(fxv, gather4_avx2(c, ci + k)))));
+		}
+		store8_bytes_avx2(o + i, r[0], r[1]);
+	}
+	bilinear_row_scalar(o + i, f, c, fi + i, ci + i, fx + i, omx + i, fy, omy, n - i);
+}
+
+__attribute__((target("avx2")))
+static void imul_row_avx2(int *y, const unsigned char *x, int w, unsigned n) {
+	const __m256i wv = _mm256_set1_epi32(w);
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(x + i)));
+		_mm256_storeu_si256((__m256i*)(y + i), _mm256_mullo_epi32(v, wv));
+	}
+	imul_row_scalar(y + i, x + i, w, n - i);
+}
+
+__attribute__((target("avx2")))
+static void imul_add_row_avx2(int *y, const unsigned char *x, int w, unsigned n) {
+	const __m256i wv = _mm256_set1_epi32(w);
+	unsigned i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		const __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(x + i)));
+		_mm256_storeu_si256((__m256i*)(y + i), _mm256_add_epi32(
+		    _mm256_loadu_si256((const __m256i*)(y + i)), _mm256_mullo_epi32(v, wv)));
+	}
+	imul_add_row_scalar(y + i, x + i, w, n - i);
+}
+
+static const struct resize_ops resize_ops_avx2 = {
+	"avx2", mul_row_avx2, mul_add_row_avx2, to_bytes_avx2, bilinear_row_avx2,
+	imul_row_avx2, imul_add_row_avx2,
+};
+#endif  /* USE_X86_SIMD */
+
+/*
+ * Sets g_resize_ops to the fastest implementation supported by the CPU.
+ * The environment variable PTS_SWIGGLE_SIMD=scalar (or sse2) limits the
+ * choice, for testing.
+ */
+static void select_resize_ops(void) {
+#ifdef USE_X86_SIMD
+	const char *limit = getenv("PTS_SWIGGLE_SIMD");
+	if (limit && 0 == strcmp(limit, "scalar")) return;
+	__builtin_cpu_init();
+	if (!(limit && 0 == strcmp(limit, "sse2")) && __builtin_cpu_supports("avx2")) {
+		g_resize_ops = &resize_ops_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		g_resize_ops = &resize_ops_sse2;
+	}
+#endif
+}
+
 /*
- * Scales image (with pixels given in "p") according to the settings in
- * "dinfo" (the source image) and "cinfo" (the target image) and stores
- * the result in "o".
+ * Scales image (with input rows returned by io->get_in_row) according to
+ * the settings in "io" and stores the result in the rows returned by
+ * io->get_out_row. Only output rows y_begin..y_end-1 are computed.
  * Scaling is done with a bicubic algorithm (stolen from ImageMagick :-)).
  */
-static void resize_bicubic(
-    unsigned num_components, unsigned output_width, unsigned output_height,
-    unsigned out_width, unsigned out_height, const unsigned char *p,
-    unsigned char *o) {
-	unsigned char *x_vector;
+static void resize_bicubic(const struct resize_io *io, unsigned y_begin, unsigned y_end) {
+	const unsigned char *x_vector;
 	int comp, next_col, next_row;
-	unsigned s_row_width, ty, t_row_width, x, y, num_rows;
-	double factor, *s, *scanline, *scale_scanline;
+	unsigned s_row_width, t_row_width, x, y, num_rows;
+	unsigned output_width = io->output_width, output_height = io->output_height;
+	const struct resize_ops *ops = g_resize_ops;
+	char is_first;
+	double factor, *s, *scale_scanline;
 	double *t, x_scale, x_span, y_scale, y_span, *y_vector;
 
 	/* RGB images have 3 components, grayscale images have only one. */
-	comp = num_components;
+	comp = io->num_components;
 	s_row_width = output_width * comp;
-	t_row_width = out_width  * comp;
-	factor = (double)out_width / (double)output_width;
+	t_row_width = io->out_width * comp;
+	factor = (double)io->factor_num / (double)io->factor_den;
 
-	check_alloc(x_vector = malloc(s_row_width * sizeof(unsigned char)));
 	check_alloc(y_vector = malloc(s_row_width * sizeof(double)));
-	check_alloc(scanline = malloc(s_row_width * sizeof(double)));
 	check_alloc(scale_scanline = malloc((t_row_width + comp) * sizeof(double)));
 
 	num_rows = 0;
@@ -1250,39 +4567,55 @@ static void resize_bicubic(
 	y_span = 1.0;
 	y_scale = factor;
 
-	for (y = 0; y < out_height; y++) {
-		ty = y * t_row_width;
+	/* Skip to the state at row y_begin, doing the same floating point
+	 * operations as the loop below, so the result is bitwise identical.
+	 */
+	for (y = 0; y < y_begin; y++) {
+		while (y_scale < y_span) {
+			if (next_row && num_rows < output_height) num_rows++;
+			y_span  -= y_scale;
+			y_scale  = factor;
+			next_row = 1;
+		}
+		if (next_row && num_rows < output_height) {
+			num_rows++;
+			next_row = 0;
+		}
+		y_scale -= y_span;
+		if (y_scale <= 0) {
+			y_scale  = factor;
+			next_row = 1;
+		}
+		y_span = 1.0;
+	}
+	x_vector = num_rows ? io->get_in_row(io, num_rows - 1) : NULL;
 
-		bzero(y_vector, s_row_width * sizeof(double));
+	for (y = y_begin; y < y_end; y++) {
 		bzero(scale_scanline, t_row_width * sizeof(double));
 
-		/* Scale Y-dimension. */
+		/* Scale Y-dimension. The first row is stored rather than added to
+		 * zeros, which gives the same result.
+		 */
+		is_first = 1;
 		while (y_scale < y_span) {
 			if (next_row && num_rows < output_height) {
 				/* Read a new scanline.  */
-				memcpy(x_vector, p, s_row_width * sizeof(unsigned char));
-				p += s_row_width;
+				x_vector = io->get_in_row(io, num_rows);
 				num_rows++;
 			}
-			for (x = 0; x < s_row_width; x++)
-				y_vector[x] += y_scale * (double)x_vector[x];
+			(is_first ? ops->mul_row : ops->mul_add_row)(y_vector, x_vector, y_scale, s_row_width);
+			is_first = 0;
 			y_span  -= y_scale;
 			y_scale  = factor;
 			next_row = 1;
 		}
 		if (next_row && num_rows < output_height) {
 			/* Read a new scanline.  */
-			memcpy(x_vector, p, s_row_width * sizeof(unsigned char));
-			p += s_row_width;
+			x_vector = io->get_in_row(io, num_rows);
 			num_rows++;
 			next_row = 0;
 		}
-		s = scanline;
-		for (x = 0; x < s_row_width; x++) {
-			y_vector[x] += y_span * (double) x_vector[x];
-			*s = y_vector[x];
-			s++;
-		}
+		(is_first ? ops->mul_row : ops->mul_add_row)(y_vector, x_vector, y_span, s_row_width);
 		y_scale -= y_span;
 		if (y_scale <= 0) {
 			y_scale  = factor;
@@ -1292,7 +4625,7 @@ static void resize_bicubic(
 
 		next_col = 0;
 		x_span   = 1.0;
-		s = scanline;
+		s = y_vector;
 		t = scale_scanline;
 
 		/* Scale X dimension. */
@@ -1326,79 +4659,402 @@ static void resize_bicubic(
 		}
 
 		/* Copy scanline to target. */
-		t = scale_scanline;
-		for (x = 0; x < t_row_width; x++)
-			o[ty+x] = (unsigned char)t[x];
+		ops->to_bytes(io->get_out_row(io, y), scale_scanline, t_row_width);
+		if (io->put_out_row) io->put_out_row(io, y);
 	}
 
-	free(x_vector);
 	free(y_vector);
-	free(scanline);
 	free(scale_scanline);
 }
 
 /*
- * Scales image (with pixels given in "p") according to the settings in
- * "dinfo" (the source image) and "cinfo" (the target image) and stores
- * the result in "o".
+ * Scales image (with input rows returned by io->get_in_row) according to
+ * the settings in "io" and stores the result in the rows returned by
+ * io->get_out_row. Only output rows y_begin..y_end-1 are computed.
  * Scaling is done with a bilinear algorithm.
  */
-static void resize_bilinear(
-    unsigned num_components, unsigned output_width, unsigned output_height,
-    unsigned out_width, unsigned out_height, const unsigned char *p,
-    unsigned char *o) {
-	double factor, fraction_x, fraction_y, one_minus_x, one_minus_y;
-	unsigned ceil_x, ceil_y, floor_x, floor_y, s_row_width;
-	unsigned tcx, tcy, tfx, tfy, tx, ty, t_row_width, x, y;
-	(void)output_height;
-
-	/* RGB images have 3 components, grayscale images have only one. */
-	s_row_width = num_components * output_width;
+static void resize_bilinear(const struct resize_io *io, unsigned y_begin, unsigned y_end) {
+	const unsigned char *pf, *pc;
+	const struct resize_ops *ops = g_resize_ops;
+	double factor, fraction_x, fraction_y, one_minus_y;
+	double *fx, *omx;
+	unsigned ceil_x, ceil_y, floor_x, floor_y, *fi, *ci;
+	unsigned c, tx, x, y, t_row_width;
+	unsigned num_components = io->num_components, out_width = io->out_width;
+
+	factor = (double)io->factor_den / (double)io->factor_num;
 	t_row_width = num_components * out_width;
-	factor = (double)output_width / (double)out_width;
-	for (y = 0; y < out_height; y++) {
-		for (x = 0; x < out_width; x++) {
-			floor_x = (unsigned)(x * factor);
-			floor_y = (unsigned)(y * factor);
-			ceil_x = (floor_x + 1 > out_width)
-			    ? floor_x
-			    : floor_x + 1;
-			ceil_y = (floor_y + 1 > out_height)
-			    ? floor_y
-			    : floor_y + 1;
-			fraction_x = (x * factor) - floor_x;
-			fraction_y = (y * factor) - floor_y;
-			one_minus_x = 1.0 - fraction_x;
-			one_minus_y = 1.0 - fraction_y;
-
-			tx  = x * num_components;
-			ty  = y * t_row_width;
-			tfx = floor_x * num_components;
-			tfy = floor_y * s_row_width;
-			tcx = ceil_x * num_components;
-			tcy = ceil_y * s_row_width;
-
-			o[tx + ty] = one_minus_y *
-			    (one_minus_x * p[tfx + tfy] +
-			    fraction_x * p[tcx + tfy]) +
-			    fraction_y * (one_minus_x * p[tfx + tcy] +
-			    fraction_x  * p[tcx + tcy]);
-
-			if (num_components != 1) {
-				o[tx + ty + 1] = one_minus_y *
-				    (one_minus_x * p[tfx + tfy + 1] +
-				    fraction_x * p[tcx + tfy + 1]) +
-				    fraction_y * (one_minus_x *
-				    p[tfx + tcy + 1] + fraction_x *
-				    p[tcx + tcy + 1]);
-
-				o[tx + ty + 2] = one_minus_y *
-				    (one_minus_x * p[tfx + tfy + 2] +
-				    fraction_x * p[tcx + tfy + 2]) +
-				    fraction_y * (one_minus_x *
-				    p[tfx + tcy + 2] + fraction_x *
-				    p[tcx + tcy + 2]);
+
+	/* Precompute the columns and weights used by each output byte. */
+	check_alloc(fi = malloc(t_row_width * 2 * sizeof(unsigned)));
+	ci = fi + t_row_width;
+	check_alloc(fx = malloc(t_row_width * 2 * sizeof(double)));
+	omx = fx + t_row_width;
+	for (x = 0; x < out_width; x++) {
+		floor_x = (unsigned)(x * factor);
+		ceil_x = (floor_x + 1 > out_width)
+		    ? floor_x
+		    : floor_x + 1;
+		fraction_x = (x * factor) - floor_x;
+		for (c = 0; c < num_components; c++) {
+			tx = x * num_components + c;
+			fi[tx] = floor_x * num_components + c;
+			ci[tx] = ceil_x * num_components + c;
+			fx[tx] = fraction_x;
+			omx[tx] = 1.0 - fraction_x;
+		}
+	}
+
+	for (y = y_begin; y < y_end; y++) {
+		floor_y = (unsigned)(y * factor);
+		ceil_y = (floor_y + 1 > io->out_height)
+		    ? floor_y
+		    : floor_y + 1;
+		fraction_y = (y * factor) - floor_y;
+		one_minus_y = 1.0 - fraction_y;
+		/* In this order, so that input rows are requested in increasing order. */
+		pf = io->get_in_row(io, floor_y);
+		pc = io->get_in_row(io, ceil_y);
+		ops->bilinear_row(io->get_out_row(io, y), pf, pc, fi, ci, fx, omx,
+		                  fraction_y, one_minus_y, t_row_width);
+		if (io->put_out_row) io->put_out_row(io, y);
+	}
+	free(fi);
+	free(fx);
+}
+
+/* --- Fixed-point resize functions (default, -F selects the ones above) */
+
+/*
+ * Weights are integers in units of 1 / (1 << FIXED_WEIGHT_BITS), and they
+ * add up to exactly 1 << FIXED_WEIGHT_BITS for each output sample. Vertical
+ * sums are rounded to units of 1/256 before the horizontal pass, and the
+ * output is rounded to the nearest integer (the double versions truncate).
+ *
+ * Error bound: each weight is off by at most 2 ** -14 (after the rounding
+ * error is moved to the largest weight), and the intermediate rounding adds
+ * at most 2 ** -9, so the value before the final rounding differs from the
+ * exact one by at most e = 255 * (cx + cy) * 2 ** -14 + 2 ** -9, where cx
+ * and cy are the numbers of input columns and rows contributing to an
+ * output pixel (ceil(1 / factor) + 1). If e < 0.5 (i.e. for reductions up
+ * to about 15x in each direction, and always for bilinear, where
+ * cx = cy = 1), each output byte of the box filter is either equal to the
+ * output of resize_bicubic or 1 larger, because that one truncates.
+ */
+#define FIXED_WEIGHT_BITS 14
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Contributions of input samples to each output sample (row or column). */
+struct fixed_weights {
+	/* Key in the cache. */
+	int filter;
+	unsigned in_size, out_size;
+	double factor;
+
+	char is_cached;
+	unsigned *first;  /* Index of the first contributing input sample. */
+	unsigned *count;  /* Number of contributing input samples. */
+	unsigned *offset;  /* Index of the first weight in w. */
+	int *w;
+};
+
+/* Returns the radius of the filter in input samples, when not downscaling. */
+static double filter_radius(int filter) {
+	return filter == RF_LANCZOS3 ? 3.0 : filter == RF_CATMULL_ROM ? 2.0 : 1.0;
+}
+
+static double filter_kernel(int filter, double x) {
+	if (x < 0) x = -x;
+	switch (filter) {
+	case RF_TRIANGLE:
+		return x < 1.0 ? 1.0 - x : 0.0;
+	case RF_CATMULL_ROM:  /* Keys cubic with a = -0.5. */
+		if (x < 1.0) return (1.5 * x - 2.5) * x * x + 1.0;
+		if (x < 2.0) return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+		return 0.0;
+	case RF_LANCZOS3:
+		if (x == 0.0) return 1.0;
+		if (x >= 3.0) return 0.0;
+		return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+	}
+	return 0.0;
+}
+
+/* Returns an upper bound on the number of input samples per output sample. */
+static unsigned filter_taps(int filter, double factor) {
+	if (filter == RF_BOX) return (unsigned)(1.0 / factor) + 3;
+	return (unsigned)(2.0 * filter_radius(filter) / (factor < 1.0 ? factor : 1.0)) + 3;
+}
+
+/* Returns the number of input rows the resize function may need at once. */
+static unsigned resize_window_rows(unsigned output_width, unsigned out_width) {
+	unsigned taps;
+	if (g_flags.bilinear || g_flags.filter == RF_BOX) return 2;
+	taps = filter_taps(g_flags.filter, (double)out_width / (double)output_width);
+	return taps > 2 ? taps : 2;
+}
+
+/*
+ * Converts the weights w[0..n-1] to fixed point in fw->w + offset, adding
+ * up to exactly 1.
+ */
+static void quantize_weights(struct fixed_weights *fw, unsigned offset, const double *w, unsigned n) {
+	double total = 0.0;
+	unsigned k, max_k = offset;
+	int sum = 0;
+	for (k = 0; k < n; ++k) total += w[k];
+	for (k = 0; k < n; ++k) {
+		const double f = total != 0.0 ? w[k] / total : k == 0;
+		fw->w[offset + k] = (int)floor(f * (1 << FIXED_WEIGHT_BITS) + 0.5);
+		sum += fw->w[offset + k];
+		if (fw->w[offset + k] > fw->w[max_k]) max_k = offset + k;
+	}
+	fw->w[max_k] += (1 << FIXED_WEIGHT_BITS) - sum;
+}
+
+/*
+ * Computes the weights in fw for its key. For RF_BOX, it does area
+ * averaging: input sample i covers [i * factor, (i + 1) * factor) in output
+ * coordinates, and its weight in output sample j is the length of the
+ * overlap with [j, j + 1). For the other filters, the filter kernel
+ * (stretched by 1 / factor when downscaling) is sampled at the input sample
+ * centers around the center of output sample j. Input samples beyond the
+ * edges are clamped to the first or last one.
+ */
+static void make_fixed_weights(struct fixed_weights *fw) {
+	const unsigned in_size = fw->in_size, out_size = fw->out_size;
+	const unsigned taps = filter_taps(fw->filter, fw->factor);
+	const double factor = fw->factor, fscale = factor < 1.0 ? factor : 1.0;
+	unsigned j, n, used = 0;
+	int i, lo, hi, ii;
+	double *w, center, support, a, b;
+
+	check_alloc(fw->first = malloc(out_size * 3 * sizeof(unsigned)));
+	fw->count = fw->first + out_size;
+	fw->offset = fw->count + out_size;
+	check_alloc(fw->w = malloc(out_size * taps * sizeof(int)));
+	check_alloc(w = malloc(taps * sizeof(double)));
+	for (j = 0; j < out_size; ++j) {
+		if (fw->filter == RF_BOX) {
+			lo = (int)(j / factor);
+			/* Step back if rounding made us skip a sliver of sample lo - 1. */
+			if (lo > 0 && lo * factor > j) --lo;
+			hi = (int)((j + 1.0) / factor) + 1;
+		} else {
+			center = (j + 0.5) / factor - 0.5;
+			support = filter_radius(fw->filter) / fscale;
+			lo = (int)ceil(center - support);
+			hi = (int)floor(center + support);
+		}
+		if (hi - lo + 1 > (int)taps) hi = lo + taps - 1;  /* Can't happen. */
+		fw->first[j] = lo < 0 ? 0 : (unsigned)lo >= in_size ? in_size - 1 : (unsigned)lo;
+		n = 0;
+		for (i = lo; i <= hi; ++i) {
+			if (fw->filter == RF_BOX) {
+				a = i * factor > j ? i * factor : j;
+				b = (i + 1) * factor < j + 1.0 ? (i + 1) * factor : j + 1.0;
+				if (b <= a) continue;
+				b -= a;
+			} else {
+				b = filter_kernel(fw->filter, (i - center) * fscale);
+			}
+			ii = i < 0 ? 0 : (unsigned)i >= in_size ? (int)in_size - 1 : i;
+			ii -= fw->first[j];
+			if (ii < 0) ii = 0;  /* Can't happen. */
+			for (; n <= (unsigned)ii; ++n) w[n] = 0.0;
+			w[ii] += b;
+		}
+		if (n == 0) w[n++] = 1.0;  /* Can't happen, but be careful. */
+		fw->offset[j] = used;
+		fw->count[j] = n;
+		quantize_weights(fw, used, w, n);
+		used += n;
+	}
+	free(w);
+}
+
+#ifndef WEIGHTS_CACHE_SIZE
+#define WEIGHTS_CACHE_SIZE 64
+#endif
+
+/*
+ * Weights computed so far, most images in a directory have the same size.
+ * Entries are never removed, if the cache is full, new weights are not
+ * cached.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	struct fixed_weights *entries[WEIGHTS_CACHE_SIZE];
+	unsigned size;
+} g_weights_cache = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+
+static const struct fixed_weights *find_cached_weights(int filter, unsigned in_size, unsigned out_size, double factor) {
+	unsigned i;
+	for (i = 0; i < g_weights_cache.size; ++i) {
+		const struct fixed_weights *fw = g_weights_cache.entries[i];
+		if (fw->filter == filter && fw->in_size == in_size &&
+		    fw->out_size == out_size && fw->factor == factor) return fw;
+	}
+	return NULL;
+}
+
+static void free_fixed_weights(const struct fixed_weights *fw) {
+	free(fw->first);
+	free(fw->w);
+	free((struct fixed_weights*)fw);
+}
+
+/* Returns the weights from the cache, or computes them. */
+static const struct fixed_weights *get_fixed_weights(int filter, unsigned in_size, unsigned out_size, double factor) {
+	const struct fixed_weights *cached;
+	struct fixed_weights *fw;
+
+	pthread_mutex_lock(&g_weights_cache.mutex);
+	cached = find_cached_weights(filter, in_size, out_size, factor);
+	pthread_mutex_unlock(&g_weights_cache.mutex);
+	if (cached) return cached;
+
+	/* Compute without holding the lock. */
+	check_alloc(fw = malloc(sizeof(*fw)));
+	fw->filter = filter;
+	fw->in_size = in_size;
+	fw->out_size = out_size;
+	fw->factor = factor;
+	make_fixed_weights(fw);
+
+	pthread_mutex_lock(&g_weights_cache.mutex);
+	if ((cached = find_cached_weights(filter, in_size, out_size, factor)) != NULL) {
+		/* Another thread was faster. */
+	} else if (g_weights_cache.size < WEIGHTS_CACHE_SIZE) {
+		fw->is_cached = 1;
+		g_weights_cache.entries[g_weights_cache.size++] = fw;
+	} else {
+		fw->is_cached = 0;
+	}
+	pthread_mutex_unlock(&g_weights_cache.mutex);
+	if (cached) {
+		free_fixed_weights(fw);
+		return cached;
+	}
+	return fw;
+}
+
+static void release_fixed_weights(const struct fixed_weights *fw) {
+	if (!fw->is_cached) free_fixed_weights(fw);
+}
+
+/* Returns (1 << FIXED_WEIGHT_BITS) * f rounded, for 0 <= f <= 1. */
+static unsigned fixed_weight(double f) {
+	return (unsigned)(f * (1 << FIXED_WEIGHT_BITS) + 0.5);
+}
+
+/*
+ * Separable resize with the filter selected by -k and precomputed
+ * weights. The default box filter is the same as resize_bicubic (area
+ * averaging), but with integer arithmetic and rounding. The same factor is
+ * used for both directions, like in resize_bicubic.
+ */
+static void resize_separable(const struct resize_io *io, unsigned y_begin, unsigned y_end) {
+	const struct resize_ops *ops = g_resize_ops;
+	const struct fixed_weights *fx, *fy;
+	const int *w, *v;
+	int *acc, sum;
+	unsigned c, comp = io->num_components, i, k, x, y;
+	unsigned s_row_width = io->output_width * comp;
+	unsigned char *o;
+	double factor = (double)io->factor_num / (double)io->factor_den;
+
+	fx = get_fixed_weights(g_flags.filter, io->output_width, io->out_width, factor);
+	fy = get_fixed_weights(g_flags.filter, io->output_height, io->out_height, factor);
+	check_alloc(acc = malloc(s_row_width * sizeof(int)));
+	for (y = y_begin; y < y_end; ++y) {
+		/* Scale Y-dimension. */
+		w = fy->w + fy->offset[y];
+		for (k = 0; k < fy->count[y]; ++k) {
+			(k == 0 ? ops->imul_row : ops->imul_add_row)(
+			    acc, io->get_in_row(io, fy->first[y] + k), w[k], s_row_width);
+		}
+		for (i = 0; i < s_row_width; ++i)  /* To units of 1/256. */
+			acc[i] = (acc[i] + (1 << (FIXED_WEIGHT_BITS - 9))) >> (FIXED_WEIGHT_BITS - 8);
+
+		/* Scale X dimension. */
+		o = io->get_out_row(io, y);
+		for (x = 0; x < io->out_width; ++x) {
+			w = fx->w + fx->offset[x];
+			v = acc + fx->first[x] * comp;
+			for (c = 0; c < comp; ++c) {
+				sum = 1 << (FIXED_WEIGHT_BITS + 7);  /* For rounding. */
+				for (k = 0; k < fx->count[x]; ++k)
+					sum += w[k] * v[k * comp + c];
+				sum >>= FIXED_WEIGHT_BITS + 8;
+				*o++ = sum < 0 ? 0 : sum > 255 ? 255 : sum;
 			}
 		}
+		if (io->put_out_row) io->put_out_row(io, y);
+	}
+	free(acc);
+	release_fixed_weights(fx);
+	release_fixed_weights(fy);
+}
+
+/*
+ * Same as resize_bilinear, but with integer arithmetic and rounding.
+ * The rows are interpolated first, then the columns.
+ */
+static void resize_bilinear_fixed(const struct resize_io *io, unsigned y_begin, unsigned y_end) {
+	const struct resize_ops *ops = g_resize_ops;
+	double factor;
+	unsigned ceil_x, ceil_y, floor_x, floor_y, *fi, *ci, *wx;
+	int *acc;
+	unsigned c, tx, x, y, wy, t_row_width, s_row_width;
+	unsigned num_components = io->num_components, out_width = io->out_width;
+	unsigned char *o;
+
+	factor = (double)io->factor_den / (double)io->factor_num;
+	t_row_width = num_components * out_width;
+	s_row_width = num_components * io->output_width;
+
+	/* Precompute the columns and weights used by each output byte. */
+	check_alloc(fi = malloc(t_row_width * 3 * sizeof(unsigned)));
+	ci = fi + t_row_width;
+	wx = ci + t_row_width;
+	for (x = 0; x < out_width; x++) {
+		floor_x = (unsigned)(x * factor);
+		ceil_x = (floor_x + 1 > out_width)
+		    ? floor_x
+		    : floor_x + 1;
+		for (c = 0; c < num_components; c++) {
+			tx = x * num_components + c;
+			fi[tx] = floor_x * num_components + c;
+			ci[tx] = ceil_x * num_components + c;
+			if (ci[tx] >= s_row_width) ci[tx] = fi[tx];
+			wx[tx] = fixed_weight((x * factor) - floor_x);
+		}
+	}
+	check_alloc(acc = malloc(s_row_width * sizeof(int)));
+
+	for (y = y_begin; y < y_end; y++) {
+		floor_y = (unsigned)(y * factor);
+		ceil_y = (floor_y + 1 > io->out_height)
+		    ? floor_y
+		    : floor_y + 1;
+		wy = fixed_weight((y * factor) - floor_y);
+		/* In this order, so that input rows are requested in increasing order. */
+		ops->imul_row(acc, io->get_in_row(io, floor_y), (1 << FIXED_WEIGHT_BITS) - wy, s_row_width);
+		ops->imul_add_row(acc, io->get_in_row(io, ceil_y), wy, s_row_width);
+		o = io->get_out_row(io, y);
+		for (tx = 0; tx < t_row_width; tx++) {
+			/* To units of 1/256, then interpolate and round. */
+			const unsigned vf = (acc[fi[tx]] + (1 << (FIXED_WEIGHT_BITS - 9))) >> (FIXED_WEIGHT_BITS - 8);
+			const unsigned vc = (acc[ci[tx]] + (1 << (FIXED_WEIGHT_BITS - 9))) >> (FIXED_WEIGHT_BITS - 8);
+			o[tx] = (((1 << FIXED_WEIGHT_BITS) - wx[tx]) * vf + wx[tx] * vc +
+			         (1 << (FIXED_WEIGHT_BITS + 7))) >> (FIXED_WEIGHT_BITS + 8);
+		}
+		if (io->put_out_row) io->put_out_row(io, y);
 	}
+	free(fi);
+	free(acc);
 }